@@ -0,0 +1,267 @@
+// bench measures the performance of the generator core without the TCP
+// server. The generator runs against a dummy gpio register for fixed 
+// workloads, and the results are printed in JSON on stdout.
+//
+// compile (from the repository root):
+//   gcc -I. bench/bench.c $(ls *.c | grep -v main.c) -O3 -latomic -lm -lpthread -Wall -o pwmbench
+
+#include "gpio.h"
+#include "generator.h"
+#include "command.h"
+#include "clock.h"
+#include "wave.h"
+#include "stream.h"
+#include "stats.h"
+#include "thread.h"
+#include "print.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define MAX_SWAPS 100000   // maximum number of measured parameter swaps
+#define COMPUTE_LOOPS 100000 // number of periods computed to measure the compute cost
+
+// workload_t is a benchmark workload.
+typedef struct {
+  const char *name;  // name of the workload in the results
+  int varying;       // 1 to generate sinusoidal and triangular variations
+  int updates;       // 1 to publish new parameters continuously
+} workload_t;
+
+workload_t workloads[] = {
+  {"cst", 0, 0},     // constant pwm on all channels
+  {"wave", 1, 0},    // sinusoidal and triangular variations on all channels
+  {"updates", 1, 1}, // variations with new parameters published continuously
+};
+
+double duration = 2;       // duration of a workload in seconds
+uint64_t swaps[MAX_SWAPS]; // parameter swap latencies in ticks
+
+// fillParams sets the parameters of all channels for the workload w. The
+// values change with i so that successive updates differ.
+static void fillParams(const workload_t *w, int i, cmdParams_t p[MAX_CHAN]) {
+  for(int ch = 0; ch < nChan; ch++) {
+    double v = ((ch + i) % 9 + 1)/10.;
+    if(!w->varying)
+      p[ch] = (cmdParams_t){CST_PARAM, v, 0, 0, 0};
+    else {
+      double a = v < .5 ? v : 1-v;
+      p[ch] = (cmdParams_t){ch & 1 ? TRI_PARAM : SIN_PARAM, v, a, .001*(ch+1), ch/(double)nChan};
+    }
+  }
+}
+
+// computeCost returns the cost in ns of computing a pwm period of the 
+// workload w: the waveform step and the edge schedule. The cost of the
+// waveform step alone is stored in wave.
+static double computeCost(const workload_t *w, double *wave) {
+  static wave_t wv;
+  cmdParams_t p[MAX_CHAN];
+  waveReset(&wv);
+  fillParams(w, 0, p);
+  for(int ch = 0; ch < nChan; ch++) {
+    genParams_t g;
+    convertParams(ch, &g, p+ch);
+    waveSet(&wv, ch, &g);
+  }
+  int pwmval[WAVE_SIZE];
+  schedule_t sched;
+  uint32_t sum = 0;
+  for(int i = 0; i < COMPUTE_LOOPS/10; i++) {
+    // warm up the caches and branch predictors
+    waveAdvance(&wv, nChan, 100000);
+    waveStep(&wv, nChan, pwmval);
+    buildSchedule(&sched, pwmval);
+    sum += sched.nEdges;
+  }
+  uint64_t t0 = clockTicks();
+  for(int i = 0; i < COMPUTE_LOOPS; i++) {
+    waveAdvance(&wv, nChan, 100000);
+    waveStep(&wv, nChan, pwmval);
+    buildSchedule(&sched, pwmval);
+    sum += sched.nEdges;
+  }
+  uint64_t t1 = clockTicks();
+  for(int i = 0; i < COMPUTE_LOOPS; i++) {
+    waveAdvance(&wv, nChan, 100000);
+    waveStep(&wv, nChan, pwmval);
+    sum += pwmval[i % nChan];
+  }
+  uint64_t t2 = clockTicks();
+  *wave = (t2 - t1)/ticksPerNs/COMPUTE_LOOPS;
+  if(sum == 1)
+    print("\n"); // prevents optimizing the loop out
+  return (t1 - t0)/ticksPerNs/COMPUTE_LOOPS;
+}
+
+static int cmpU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// run runs the generator with the workload w and prints its results.
+static void run(const workload_t *w, int first) {
+  cmdParams_t p[MAX_CHAN];
+  bool all[MAX_CHAN];
+  for(int ch = 0; ch < MAX_CHAN; ch++)
+    all[ch] = ch < nChan;
+  double wave, compute = computeCost(w, &wave);
+
+  resetParams();
+  streamReset();
+  atomic_store(&generatorRunning, true);
+  if(startThread(&generator) < 0) {
+    printErr("bench error: failed starting the generator\n");
+    exit(1);
+  }
+  fillParams(w, 0, p);
+  setParams(p, all);
+  waitParams();
+  usleep(200000); // let the statistics be reset
+
+  stats_t *s0 = malloc(sizeof(stats_t)), *s1 = malloc(sizeof(stats_t));
+  statsSnapshot(s0);
+  uint64_t begin = clockTicks(), end = begin + duration*1e9*ticksPerNs;
+  uint64_t setTicks = 0;
+  int nSwaps = 0, nUpdates = 0;
+  while(clockTicks() < end) {
+    if(!w->updates) {
+      usleep(10000);
+      continue;
+    }
+    fillParams(w, ++nUpdates, p);
+    uint64_t t0 = clockTicks();
+    setParams(p, all);
+    uint64_t t1 = clockTicks();
+    while(paramsPending() && clockTicks() < end);
+    uint64_t t2 = clockTicks();
+    setTicks += t1 - t0;
+    if(nSwaps < MAX_SWAPS && !paramsPending())
+      swaps[nSwaps++] = t2 - t1;
+  }
+  usleep(200000); // let the statistics be published
+  statsSnapshot(s1);
+  publishParams(NULL, PARAMS_STOP);
+  while(atomic_load(&generatorRunning))
+    usleep(1000);
+
+  // the statistics are published every 100ms
+  double periods = s1->periods - s0->periods, ns = (s1->ticks - s0->ticks)/ticksPerNs;
+  for(int b = 0; b < STATS_BUCKETS; b++)
+    s1->period[b] -= s0->period[b];
+  uint64_t p50 = statsPercentile(s1->period, .5, s1->periodMax), p99 = statsPercentile(s1->period, .99, s1->periodMax);
+  qsort(swaps, nSwaps, sizeof(swaps[0]), cmpU64);
+  // only the loop mode emits each step of the period
+  bool loop = emitMode == EMIT_LOOP;
+  printf("%s    {\"name\": \"%s\", \"periods\": %.0f, \"periodsPerSecond\": %.1f, \"%s\": %.3f,\n", 
+    first ? "" : ",\n", w->name, periods, periods*1e9/ns, loop ? "nsPerStep" : "nsPerPeriod", 
+    periods > 0 ? ns/periods/(loop ? MAX_VALUE : 1) : 0);
+  printf("     \"periodP50Ns\": %llu, \"periodP99Ns\": %llu, \"periodMaxNs\": %llu, \"computeNs\": %.1f, \"waveNs\": %.1f,\n",
+    (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)s1->periodMax, compute, wave);
+  printf("     \"updates\": %d, \"updateNs\": %.1f, \"swapP50Ns\": %.0f, \"swapP99Ns\": %.0f, \"swapMaxNs\": %.0f}",
+    nUpdates, nUpdates > 0 ? setTicks/ticksPerNs/nUpdates : 0, 
+    nSwaps > 0 ? swaps[nSwaps/2]/ticksPerNs : 0, nSwaps > 0 ? swaps[nSwaps*99/100]/ticksPerNs : 0,
+    nSwaps > 0 ? swaps[nSwaps-1]/ticksPerNs : 0);
+  free(s0);
+  free(s1);
+}
+
+void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-m edge|loop] [-f hz] [-p pins] [-r bits] [-F carriers] [-c core] [-d seconds] [-w workload]\n", name);
+  fprintf(stderr, "  -m mode     pwm emission mode: edge (default) or loop\n");
+  fprintf(stderr, "  -f hz       pwm carrier frequency in Hz (default 0 = free running)\n");
+  fprintf(stderr, "  -p pins     comma separated GPIO ids of the channels (default %s)\n", DEFAULT_PINS);
+  fprintf(stderr, "  -r bits     resolution of the pwm values in bits, %d to %d (default %d)\n", MIN_RESOLUTION, MAX_RESOLUTION, BITS_RESOLUTION);
+  fprintf(stderr, "  -F list     comma separated ch=hz or ch=hz/bits giving channels their own carrier\n");
+  fprintf(stderr, "  -c core     compute the pwm periods ahead in a thread pinned on core\n");
+  fprintf(stderr, "  -d seconds  duration of each workload (default 2)\n");
+  fprintf(stderr, "  -w workload run only the workload cst, wave or updates\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  const char *only = NULL, *carriers = NULL;
+  carrierFrequency = 0;
+  while((opt = getopt(argc, argv, "m:f:p:r:F:c:d:w:")) != -1) {
+    switch(opt) {
+    case 'm':
+      if(strcmp(optarg, "edge") == 0)
+        emitMode = EMIT_EDGE;
+      else if(strcmp(optarg, "loop") == 0)
+        emitMode = EMIT_LOOP;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'f':
+      carrierFrequency = atof(optarg);
+      if(carrierFrequency < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'p':
+      if(gpio_config(optarg) < 0)
+        return 1;
+      break;
+    case 'r':
+      bitsResolution = atoi(optarg);
+      if(bitsResolution < MIN_RESOLUTION || bitsResolution > MAX_RESOLUTION) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'F':
+      carriers = optarg;
+      break;
+    case 'c':
+      computeCore = atoi(optarg);
+      if(computeCore < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'd':
+      duration = atof(optarg);
+      if(duration <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'w':
+      only = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(clockInit() < 0)
+    return 1;
+  // never drive the real gpio
+  static uint32_t dummyRegister;
+  if(nChan == 0 && gpio_config(DEFAULT_PINS) < 0)
+    return 1;
+  gpioSet = gpioClr = &dummyRegister;
+  if(carriers != NULL && (emitMode == EMIT_LOOP || carrierConfig(carriers) < 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  printf("{\"kernel\": \"%s\", \"mode\": \"%s\", \"channels\": %d, \"carrier\": %g, \"steps\": %d, \"computeCore\": %d, \"carriers\": \"%s\", \"workloads\": [\n",
+    waveKernel, emitMode == EMIT_LOOP ? "loop" : "edge", nChan, carrierFrequency, MAX_VALUE, computeCore, carriers != NULL ? carriers : "");
+  int first = 1;
+  for(size_t i = 0; i < sizeof(workloads)/sizeof(workloads[0]); i++) {
+    if(only != NULL && strcmp(only, workloads[i].name) != 0)
+      continue;
+    run(workloads+i, first);
+    first = 0;
+    fflush(stdout);
+  }
+  printf("\n]}\n");
+  return 0;
+}
@@ -0,0 +1,112 @@
+// parse measures the cost of decoding the arguments of SPRM and TPRM
+// requests with the request parser and with the sscanf calls it replaced.
+// The results are printed in JSON on stdout in ns per request.
+//
+// compile (from the repository root):
+//   gcc -I. bench/parse.c parse.c -O3 -Wall -o pwmparse
+
+#include "parse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOPS 200000 // number of decoded requests per measure
+
+// request_t is a benchmarked request without its 5 bytes command code.
+typedef struct {
+  const char *name;  // name of the request in the results
+  const char *args;  // arguments ending with a newline
+  int timed;         // 1 when the arguments start with a time as for TPRM
+} request_t;
+
+request_t requests[] = {
+  {"sprm1", "1, 0 CST 0.5 0 0 0\n", 0},
+  {"sprm8", "8, 0 SIN 0.5 0.25 0.1 0, 1 TRI 0.5 0.5 0.01 0.25, 2 CST 0.3 0 0 0, 3 CST 1 0 0 0, "
+    "4 SIN 0.4 0.35 0.0025 0.5, 5 TRI 0.6 0.2 1.5 0.125, 6 CST 0.125 0 0 0, 7 SIN 0.5 0.5 100 0.75\n", 0},
+  {"tprm4", "1760000000.123456 4, 0 SIN 0.5 0.25 0.1 0, 1 TRI 0.5 0.5 0.01 0.25, 2 CST 0.3 0 0 0, 3 CST 1 0 0 0\n", 1},
+};
+
+long sink; // sum of the decoded channels so that they are not optimized out
+
+// nowNs returns the CLOCK_MONOTONIC time in ns.
+static double nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1e9 + t.tv_nsec;
+}
+
+// decodeScanf decodes the arguments as requestSetParams and
+// requestTimedParams did with sscanf and strtod.
+static int decodeScanf(const request_t *r) {
+  char *p = (char*)r->args;
+  if(r->timed) {
+    char *e;
+    if(strtod(p, &e) < 0)
+      return -1;
+    p = e;
+  }
+  int nParams, consumed;
+  if(sscanf(p, "%d%n", &nParams, &consumed) <= 0)
+    return -1;
+  p += consumed;
+  for(int i = 0; i < nParams; i++) {
+    int ch;
+    char type[4];
+    double v[4];
+    if(sscanf(p, ", %d %3s %lg %lg %lg %lg%n", &ch, type, v, v+1, v+2, v+3, &consumed) <= 0)
+      return -1;
+    p += consumed;
+    sink += ch + type[0] + (v[0] + v[1] + v[2] + v[3] > 2);
+  }
+  return 0;
+}
+
+// decodeParser decodes the arguments with the request parser.
+static int decodeParser(const request_t *r) {
+  char *p = (char*)r->args, *end = p + strlen(p) - 1;
+  if(r->timed) {
+    double time;
+    if((p = parseDouble(p, end, &time)) == NULL || time < 0)
+      return -1;
+  }
+  int nParams;
+  if((p = parseInt(p, end, &nParams)) == NULL)
+    return -1;
+  for(int i = 0; i < nParams; i++) {
+    int ch;
+    char type[4];
+    double v[4];
+    if(parseChannel(p, end, &ch, type, v, &p) <= 0)
+      return -1;
+    sink += ch + type[0] + (v[0] + v[1] + v[2] + v[3] > 2);
+  }
+  return 0;
+}
+
+// measure returns the cost in ns of decoding the request r with decode.
+static double measure(const request_t *r, int (*decode)(const request_t*)) {
+  double best = 0;
+  for(int k = 0; k < 5; k++) {
+    double t = nowNs();
+    for(int i = 0; i < LOOPS; i++)
+      if(decode(r) < 0)
+        return -1;
+    t = (nowNs() - t)/LOOPS;
+    if(k == 0 || t < best)
+      best = t;
+  }
+  return best;
+}
+
+int main() {
+  printf("{\"requests\": [\n");
+  for(size_t i = 0; i < sizeof(requests)/sizeof(requests[0]); i++) {
+    double s = measure(requests+i, decodeScanf), p = measure(requests+i, decodeParser);
+    printf("%s  {\"name\": \"%s\", \"sscanfNs\": %.1f, \"parserNs\": %.1f, \"speedup\": %.1f}",
+      i == 0 ? "" : ",\n", requests[i].name, s, p, p > 0 ? s/p : 0);
+  }
+  printf("\n], \"sink\": %ld}\n", sink);
+  return 0;
+}
@@ -0,0 +1,279 @@
+// shmclient is a minimal client of the shared memory control segment of
+// the generator (see shm.h). It sets the parameters of a channel in a
+// loop, checks that each accepted request is published in the telemetry
+// of the segment, and prints the request round trip times in JSON on
+// stdout. With -c, several client processes send their requests at once
+// to exercise the request lock: only the first one takes the control and
+// the others must be answered with a busy error. A client notices when
+// the generator exits or is restarted, and maps the new segment.
+//
+// compile (from the repository root):
+//   gcc -I. bench/shmclient.c -O3 -Wall -o shmclient
+
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MAX_REQUESTS 1000000 // maximum number of requests of a client
+#define WAIT_MS 100          // futex wait timeout in ms between generator checks
+#define MAP_TIMEOUT 10000    // time in ms given to the generator to create the segment
+
+const char *name;           // name of the segment
+int fd = -1;                // file descriptor of the mapped segment
+shmSegment_t *seg;          // mapped segment
+int restarts;               // number of times the segment was mapped again
+uint64_t rtt[MAX_REQUESTS]; // round trip times of the requests in ns
+
+static uint64_t nanos() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+// futexWait blocks until *addr is no longer val, it is woken up, or ms
+// milliseconds elapsed. The futexes of the segment are shared between
+// processes and must not use the private flag.
+static void futexWait(atomic_uint *addr, unsigned val, int ms) {
+  struct timespec t = {ms/1000, (ms%1000)*1000000};
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &t, NULL, 0);
+}
+
+// futexWake wakes up the processes waiting on *addr.
+static void futexWake(atomic_uint *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// alive returns false when the process pid exited.
+static bool alive(int pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// shmMap maps the segment, waiting until a running generator initialized
+// it. Returns -1 if it fails.
+static int shmMap() {
+  uint64_t deadline = nanos() + MAP_TIMEOUT*1000000ull;
+  while(1) {
+    struct stat st;
+    if((fd = shm_open(name, O_RDWR, 0)) < 0 && errno != ENOENT) {
+      fprintf(stderr, "shmclient error: shm_open %s: %s\n", name, strerror(errno));
+      return -1;
+    }
+    if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(shmSegment_t)) {
+      seg = mmap(NULL, sizeof(shmSegment_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+      if(seg == MAP_FAILED) {
+        fprintf(stderr, "shmclient error: mmap %s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
+      }
+      if(__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC && alive(seg->serverPid)) {
+        if(seg->version == SHM_VERSION)
+          return 0;
+        fprintf(stderr, "shmclient error: expect segment version %d, got %u\n", SHM_VERSION, seg->version);
+        return -1;
+      }
+      munmap(seg, sizeof(shmSegment_t));
+    }
+    if(fd >= 0)
+      close(fd);
+    if(nanos() > deadline) {
+      fprintf(stderr, "shmclient error: no generator serving %s\n", name);
+      return -1;
+    }
+    usleep(10000);
+  }
+}
+
+// shmRemap maps the segment of the restarted generator.
+static int shmRemap() {
+  munmap(seg, sizeof(shmSegment_t));
+  close(fd);
+  restarts++;
+  return shmMap();
+}
+
+// shmStale returns true when the generator serving the segment exited,
+// or unlinked it to create a new one.
+static bool shmStale() {
+  struct stat st;
+  return !alive(seg->serverPid) || fstat(fd, &st) < 0 || st.st_nlink == 0;
+}
+
+// shmSet sets the parameters p of the channels flagged in flags, or
+// releases the control when flags is 0. Returns 0 if the generator
+// accepted the request, 1 if it rejected it with the error message copied
+// in err, or -1 if the segment is stale.
+static int shmSet(uint32_t flags, const shmParams_t p[SHM_MAX_CHAN], char err[SHM_ERR_SIZE]) {
+  int pid = getpid(), holder = 0;
+  // claim the request
+  while(!atomic_compare_exchange_strong(&seg->reqLock, &holder, pid)) {
+    futexWait((atomic_uint*)&seg->reqLock, holder, WAIT_MS);
+    if(shmStale())
+      return -1;
+    holder = 0;
+  }
+  // write the request
+  unsigned seq = atomic_load_explicit(&seg->reqSeq, memory_order_relaxed);
+  atomic_store_explicit(&seg->reqSeq, seq+1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  seg->reqPid = pid;
+  seg->reqFlags = flags;
+  for(uint32_t m = flags; m != 0; m &= m-1)
+    seg->req[__builtin_ctz(m)] = p[__builtin_ctz(m)];
+  atomic_store_explicit(&seg->reqSeq, seq+2, memory_order_release);
+  futexWake(&seg->reqSeq);
+  // wait for the response
+  unsigned ack;
+  while((ack = atomic_load_explicit(&seg->ackSeq, memory_order_acquire)) != seq+2) {
+    futexWait(&seg->ackSeq, ack, WAIT_MS);
+    if(shmStale())
+      return -1;
+  }
+  int res = seg->ackStatus == 0 ? 0 : 1;
+  if(res != 0)
+    snprintf(err, SHM_ERR_SIZE, "%.*s", SHM_ERR_SIZE-1, seg->ackErr);
+  atomic_store(&seg->reqLock, 0);
+  futexWake((atomic_uint*)&seg->reqLock);
+  return res;
+}
+
+// shmParams returns the parameters of channel ch published in the
+// telemetry of the segment.
+static shmParams_t shmParams(int ch) {
+  shmParams_t p;
+  unsigned seq0, seq1;
+  do {
+    seq0 = atomic_load_explicit(&seg->telSeq, memory_order_acquire);
+    p = seg->params[ch];
+    atomic_thread_fence(memory_order_acquire);
+    seq1 = atomic_load_explicit(&seg->telSeq, memory_order_relaxed);
+  } while((seq0 & 1) != 0 || seq0 != seq1);
+  return p;
+}
+
+static int cmpU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// client sends n requests setting channel ch, releases the control and
+// prints its results. Returns -1 if it fails.
+static int client(int id, int n, int ch) {
+  if(shmMap() < 0)
+    return -1;
+  if(ch >= (int)seg->nChan) {
+    fprintf(stderr, "shmclient error: expect a channel in range [0,%u], got %d\n", seg->nChan-1, ch);
+    return -1;
+  }
+  shmParams_t p[SHM_MAX_CHAN];
+  memset(p, 0, sizeof(p));
+  char err[SHM_ERR_SIZE], lastErr[SHM_ERR_SIZE] = "";
+  int accepted = 0, rejected = 0, mismatches = 0;
+  for(int i = 0; i < n;) {
+    p[ch].average = i & 1 ? .75 : .25;
+    uint64_t t0 = nanos();
+    int res = shmSet(1u << ch, p, err);
+    uint64_t t1 = nanos();
+    if(res < 0) {
+      // the request is sent again to the new generator
+      if(shmRemap() < 0)
+        return -1;
+      continue;
+    }
+    rtt[i++] = t1 - t0;
+    if(res == 0) {
+      accepted++;
+      shmParams_t q = shmParams(ch);
+      if(q.type != 0 || q.average != p[ch].average)
+        mismatches++;
+    } else {
+      rejected++;
+      strcpy(lastErr, err);
+    }
+  }
+  while(shmSet(0, p, err) < 0)
+    if(shmRemap() < 0)
+      return -1;
+
+  qsort(rtt, n, sizeof(rtt[0]), cmpU64);
+  printf("{\"client\": %d, \"pid\": %d, \"requests\": %d, \"accepted\": %d, \"rejected\": %d, \"mismatches\": %d, "
+    "\"restarts\": %d, \"rttP50Ns\": %llu, \"rttP99Ns\": %llu, \"rttMaxNs\": %llu, \"lastError\": \"%s\"}\n",
+    id, getpid(), n, accepted, rejected, mismatches, restarts, (unsigned long long)rtt[n/2],
+    (unsigned long long)rtt[n*99/100], (unsigned long long)rtt[n-1], lastErr);
+  fflush(stdout);
+  return 0;
+}
+
+void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-n requests] [-c clients] [-C channel] shm\n", name);
+  fprintf(stderr, "  -n requests number of requests of each client (default 10000)\n");
+  fprintf(stderr, "  -c clients  number of concurrent client processes (default 1)\n");
+  fprintf(stderr, "  -C channel  channel set by the requests (default 0)\n");
+  fprintf(stderr, "  shm         name of the control segment given to the generator with -S\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt, n = 10000, clients = 1, ch = 0;
+  while((opt = getopt(argc, argv, "n:c:C:")) != -1) {
+    switch(opt) {
+    case 'n':
+      n = atoi(optarg);
+      if(n <= 0 || n > MAX_REQUESTS) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'c':
+      clients = atoi(optarg);
+      if(clients <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'C':
+      ch = atoi(optarg);
+      if(ch < 0 || ch >= SHM_MAX_CHAN) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(optind != argc-1) {
+    usage(argv[0]);
+    return 1;
+  }
+  name = argv[optind];
+  if(clients == 1)
+    return client(0, n, ch) < 0 ? 1 : 0;
+  for(int i = 0; i < clients; i++) {
+    pid_t pid = fork();
+    if(pid < 0) {
+      fprintf(stderr, "shmclient error: fork: %s\n", strerror(errno));
+      return 1;
+    }
+    if(pid == 0)
+      return client(i, n, ch) < 0 ? 1 : 0;
+  }
+  int failed = 0, status;
+  while(wait(&status) > 0)
+    failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  return failed != 0;
+}
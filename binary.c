@@ -0,0 +1,126 @@
+#include "binary.h"
+#include "command.h"
+#include "server.h"
+#include "generator.h"
+#include "print.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the binary protocol requires a little endian host"
+#endif
+
+_Static_assert(sizeof(binRecord_t) == BIN_RECORD_SIZE, "unexpected binRecord_t size");
+
+// binRsp is the response buffer with room for the records of all channels.
+static uint8_t binRsp[BIN_HEADER_SIZE + MAX_CHAN*BIN_RECORD_SIZE];
+
+// binarySend sends the response of operation op with the given status 
+// and the len bytes of payload already stored after the header in binRsp.
+static int binarySend(uint8_t op, uint8_t status, uint16_t len) {
+  binRsp[0] = op;
+  binRsp[1] = status;
+  memcpy(binRsp+2, &len, 2);
+  return sendBuf(&conn, binRsp, BIN_HEADER_SIZE+len);
+}
+
+// binaryError sends an error response to operation op with the message msg.
+static int binaryError(uint8_t op, const char *msg) {
+  int len = strlen(msg);
+  if(len > (int)sizeof(binRsp) - BIN_HEADER_SIZE)
+    len = sizeof(binRsp) - BIN_HEADER_SIZE;
+  memcpy(binRsp+BIN_HEADER_SIZE, msg, len);
+  return binarySend(op, BIN_ERROR, len);
+}
+
+// binaryGetParams sends the parameters of all channels.
+static int binaryGetParams() {
+  binRecord_t r = {0};
+  cmdParams_t p[MAX_CHAN];
+  snapshotParams(p);
+  for(int ch = 0; ch < nChan; ch++) {
+    r.ch = ch;
+    r.type = p[ch].type;
+    r.average = p[ch].average;
+    r.amplitude = p[ch].amplitude;
+    r.period = p[ch].period;
+    r.start = p[ch].start;
+    memcpy(binRsp+BIN_HEADER_SIZE+ch*BIN_RECORD_SIZE, &r, BIN_RECORD_SIZE);
+  }
+  return binarySend(BIN_GET, BIN_OK, nChan*BIN_RECORD_SIZE);
+}
+
+// binarySetParams sets the parameters of the n channels whose records
+// are in payload. The change is atomic as with SPRM.
+static int binarySetParams(const uint8_t *payload, int n) {
+  char msg[128];
+  cmdParams_t newCmdParams[MAX_CHAN];
+  bool hasCmdParams[MAX_CHAN] = {0};
+  binRecord_t r;
+  for(int i = 0; i < n; i++) {
+    memcpy(&r, payload+i*BIN_RECORD_SIZE, BIN_RECORD_SIZE);
+    if(r.ch >= nChan) {
+      snprintf(msg, sizeof(msg), "record[%d]: expect channel in range [0,%d], got %d", i, nChan-1, r.ch);
+      return binaryError(BIN_SET, msg);
+    }
+    if(r.type > ARB_PARAM || r.pad != 0) {
+      snprintf(msg, sizeof(msg), "record[%d]: invalid type %d or pad %d", i, r.type, r.pad);
+      return binaryError(BIN_SET, msg);
+    }
+    if(hasCmdParams[r.ch]) {
+      snprintf(msg, sizeof(msg), "record[%d]: channel %d is already set", i, r.ch);
+      return binaryError(BIN_SET, msg);
+    }
+    hasCmdParams[r.ch] = true;
+    newCmdParams[r.ch] = (cmdParams_t){r.type, r.average, r.amplitude, r.period, r.start};
+  }
+  char *err = setParams(newCmdParams, hasCmdParams);
+  if(err != NULL)
+    return binaryError(BIN_SET, err);
+  return binarySend(BIN_SET, BIN_OK, 0);
+}
+
+// binaryFrequency sends the mean frequency and its standard deviation.
+// It doesn't wait for the first measurement, the mean is then 0.
+static int binaryFrequency() {
+  double v[2];
+  generatorFrequency(v, v+1);
+  memcpy(binRsp+BIN_HEADER_SIZE, v, sizeof(v));
+  return binarySend(BIN_FREQ, BIN_OK, sizeof(v));
+}
+
+// binaryRequest reads and handles one binary request of the active
+// connection. Returns a value <= 0 when the connection must be closed.
+int binaryRequest() {
+  int res;
+  if((res = recvBuf(&conn, BIN_HEADER_SIZE)) <= 0)
+    return res;
+  uint8_t op = conn.msg[0], count = conn.msg[1];
+  uint16_t len;
+  memcpy(&len, conn.msg+2, 2);
+  if(len > 0 && (res = recvBuf(&conn, len)) <= 0) {
+    if(res == -2)
+      printWarn("binary warning: payload length %d too big from %s\n", len, conn.addrStr);
+    return res;
+  }
+  const uint8_t *payload = (const uint8_t*)conn.msg;
+  switch(op) {
+  case BIN_GET:
+    if(len != 0)
+      return binaryError(op, "unexpected payload");
+    return binaryGetParams();
+  case BIN_SET:
+    if(count == 0 || len != count*BIN_RECORD_SIZE)
+      return binaryError(op, "payload length mismatch record count");
+    return binarySetParams(payload, count);
+  case BIN_FREQ:
+    if(len != 0)
+      return binaryError(op, "unexpected payload");
+    return binaryFrequency();
+  default:
+    printWarn("binary warning: received undefined operation %d from %s\n", op, conn.addrStr);
+    return binaryError(op, "undefined operation");
+  }
+}
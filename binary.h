@@ -0,0 +1,40 @@
+#ifndef BINARY_H
+#define BINARY_H
+
+#include <stdint.h>
+
+// The binary protocol is selected with the PWM1 greeting. A request is
+// a 4 byte header followed by a payload. The header holds the operation
+// code (uint8), the number of records in the payload (uint8) and the 
+// payload length in bytes (uint16). A response has the same header 
+// where the count is replaced by a status (0 = ok, 1 = error). The 
+// payload of an error response is the error message text. All values
+// are little endian.
+
+#define BIN_HEADER_SIZE 4  // size of request and response headers
+#define BIN_RECORD_SIZE 36 // size of a channel parameters record
+
+#define BIN_GET  1 // get the parameters of all channels
+#define BIN_SET  2 // set the parameters of channels
+#define BIN_FREQ 3 // get the mean frequency and its standard deviation
+
+#define BIN_OK    0 // response status when the request succeeded
+#define BIN_ERROR 1 // response status when the request failed
+
+// binRecord_t is the layout of a channel parameters record. The pad
+// must be 0.
+typedef struct __attribute__((packed)) {
+  uint8_t ch;       // channel number
+  uint8_t type;     // type of generation as in cmdParams_t
+  uint16_t pad;     // reserved, must be 0
+  double average;   // average (rate for ARB)
+  double amplitude; // amplitude (loop for ARB)
+  double period;    // period (count for ARB)
+  double start;     // start
+} binRecord_t;
+
+// binaryRequest reads and handles one binary request of the active
+// connection. Returns a value <= 0 when the connection must be closed.
+int binaryRequest();
+
+#endif // BINARY_H
@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include "clock.h"
+#include "print.h"
+
+#include <string.h>
+#include <errno.h>
+
+#define CALIBRATION_NS  20000000  // duration of the initial calibration
+#define CORRECTION_NS  100000000  // minimum duration between two corrections
+#define CORRECTION_ALPHA 0.1      // weight of a new tick rate measure
+
+volatile double ticksPerNs = 1;   // calibrated number of ticks per nanosecond
+uint64_t refTicks, refNanos;      // reference point of the next correction
+
+// clockNanos returns the current CLOCK_MONOTONIC_RAW time in nanoseconds.
+uint64_t clockNanos() {
+  struct timespec t;
+  if(clock_gettime(CLOCK_MONOTONIC_RAW, &t) < 0) {
+    printErr("clockNanos: %s\n", strerror(errno));
+    return 0;
+  }
+  return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+}
+
+// sample reads the tick counter and the monotonic clock as close as
+// possible by keeping the shortest of a few tries.
+static void sample(uint64_t *ticks, uint64_t *nanos) {
+  uint64_t best = UINT64_MAX;
+  *ticks = *nanos = 0;
+  for(int i = 0; i < 5; i++) {
+    uint64_t t0 = clockTicks();
+    uint64_t ns = clockNanos();
+    uint64_t t1 = clockTicks();
+    if(t1 - t0 < best) {
+      best = t1 - t0;
+      *ticks = t0 + (t1 - t0)/2;
+      *nanos = ns;
+    }
+  }
+}
+
+// clockInit calibrates the tick rate. It blocks for about 20ms. Returns
+// 0 when it succeeds and -1 otherwise.
+int clockInit() {
+  uint64_t ticks, nanos;
+  sample(&refTicks, &refNanos);
+  struct timespec d = {0, CALIBRATION_NS};
+  while(nanosleep(&d, &d) < 0 && errno == EINTR);
+  sample(&ticks, &nanos);
+  if(nanos <= refNanos || ticks <= refTicks) {
+    printErr("clockInit: failed calibrating the tick counter\n");
+    return -1;
+  }
+  ticksPerNs = (double)(ticks - refTicks)/(nanos - refNanos);
+  refTicks = ticks;
+  refNanos = nanos;
+  return 0;
+}
+
+// clockCorrect updates the calibrated tick rate from the time elapsed since
+// the previous correction. It should be called regularly by a single thread.
+// Calls less than 100ms apart are ignored.
+void clockCorrect() {
+  uint64_t ticks = clockTicks();
+  if((double)(ticks - refTicks) < ticksPerNs*CORRECTION_NS)
+    return;
+  uint64_t nanos;
+  sample(&ticks, &nanos);
+  if(nanos > refNanos && ticks > refTicks) {
+    double rate = (double)(ticks - refTicks)/(nanos - refNanos);
+    ticksPerNs += CORRECTION_ALPHA*(rate - ticksPerNs);
+  }
+  refTicks = ticks;
+  refNanos = nanos;
+}
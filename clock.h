@@ -0,0 +1,43 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// The clock provides high resolution time stamps in ticks of the cpu
+// cycle counter when there is one (x86 TSC, aarch64 virtual counter),
+// or in nanoseconds of CLOCK_MONOTONIC_RAW otherwise. Reading the
+// cycle counter doesn't require a system call and is cheaper than
+// clock_gettime. The tick rate is calibrated against CLOCK_MONOTONIC_RAW
+// by clockInit and corrected by clockCorrect while the program runs.
+
+extern volatile double ticksPerNs; // calibrated number of ticks per nanosecond
+
+// clockTicks returns the current value of the tick counter.
+static inline uint64_t clockTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+#endif
+}
+
+// clockNanos returns the current CLOCK_MONOTONIC_RAW time in nanoseconds.
+uint64_t clockNanos();
+
+// clockInit calibrates the tick rate. It blocks for about 20ms. Returns
+// 0 when it succeeds and -1 otherwise.
+int clockInit();
+
+// clockCorrect updates the calibrated tick rate from the time elapsed since
+// the previous correction. It should be called regularly by a single thread.
+// Calls less than 100ms apart are ignored.
+void clockCorrect();
+
+#endif // CLOCK_H
@@ -5,52 +5,53 @@
 #include "hexdump.h"
 #include "print.h"
 #include "thread.h"
+#include "stream.h"
+#include "binary.h"
+#include "stats.h"
+#include "wave.h"
+#include "parse.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
 
 
 char *version = "v0.1.2";
 
-#define PI 3.14159265358979323846
-
 #define CMD_GET_STATUS 0
 #define CMD_SET_PARAMS 1
 
-// cmdParams hols the user provided parameters. The type is specify the 
-// type of generation: 0 = cst, 1 = sinusoidal, 2 = triangular. When cst,
-// only the average must be provided, all other values mist be 0.
-// When sinusoidal, the amplitude must be different from 0, and 
-// amplitude+average <= 1 and average-amplitude >= 0. The start is a 
-// value in the range [0,1] and specifies the advance in the period
-// at the start of generation.
-// When triangular, it is the same as for sinusoidal except that the
-// generated signal will be triangular.
-
-#define CST_PARAM 0
-#define SIN_PARAM 1
-#define TRI_PARAM 2
-
-typedef struct {
-  uint8_t type;     // type of generation: 0 = cst, 1 = sinusoidal, 2 = triangular
-  double average;   // value in the range [0,1]
-  double amplitude; // amplitude of variation 
-  double period;    // duration in seconds of one period
-  double start;     // start in percentage of period range [0,1]
-} cmdParams_t;
-
-cmdParams_t cmdParams[NCHAN];
+cmdParams_t cmdParams[MAX_CHAN];
+atomic_uint cmdParamsSeq; // odd while cmdParams is being modified
+uint32_t cmdParamsPub[MAX_CHAN]; // publication number of the parameters set with publishParams
 char errStr[1024];
 
+// Samples of the arbitrary variations. Each channel has two banks so
+// that new samples can be uploaded while the generator plays the other.
+uint16_t arbTables[MAX_CHAN][2][ARB_MAX_SAMPLES];
+uint32_t arbLen[MAX_CHAN][2]; // number of samples in each bank
+int arbUpload[MAX_CHAN];      // bank receiving the uploaded samples
+int arbPlay[MAX_CHAN];        // bank of the last published arbitrary variation
+
+// Command parameters of the queued timed parameter sets by slot. They are
+// stored in cmdParams by the generator when it applies the set.
+cmdParams_t timedCmdParams[TIMED_SIZE][MAX_CHAN];
+uint32_t timedFlags[TIMED_SIZE]; // channels set by the timed set
+uint32_t timedArb[TIMED_SIZE];   // channels set to an arbitrary variation by the timed set
+
 
 // checkParams checks the validity of the given params and return NULL
 // if everything is OK. It returns a pointer to errStr that has
 // been filled with an error message to return if a field is invalid.
 char* checkParams(int ch, cmdParams_t *p) {
   double val;
+  if(!isfinite(p->average) || !isfinite(p->amplitude) || !isfinite(p->period) || !isfinite(p->start)) {
+    snprintf(errStr, sizeof(errStr), "channel[%d]: expect finite parameters, got %f %f %f %f", ch, p->average, p->amplitude, p->period, p->start);
+    return errStr;
+  }
   switch(p->type) {
   case CST_PARAM:
     if(p->average < 0 || p->average > 1) {
@@ -126,6 +127,24 @@ char* checkParams(int ch, cmdParams_t *p) {
       return errStr;
     }
     break;
+  case ARB_PARAM:
+    if(p->average <= 0 || p->average > ARB_MAX_RATE) {
+      snprintf(errStr, sizeof(errStr), "channel[%d]: expect rate of arbitrary function to be in the range ]0,%g], got %f", ch, (double)ARB_MAX_RATE, p->average);
+      return errStr;
+    }
+    if(p->amplitude != 0 && p->amplitude != 1) {
+      snprintf(errStr, sizeof(errStr), "channel[%d]: expect loop of arbitrary function to be 0 or 1, got %f", ch, p->amplitude);
+      return errStr;
+    }
+    if(p->period != arbLen[ch][arbUpload[ch]] || p->period == 0) {
+      snprintf(errStr, sizeof(errStr), "channel[%d]: expect number of samples of arbitrary function to be %u, got %f", ch, arbLen[ch][arbUpload[ch]], p->period);
+      return errStr;
+    }
+    if(p->start < 0 || p->start >= 1) {
+      snprintf(errStr, sizeof(errStr), "channel[%d]: expect start of arbitrary function to be in the range [0,1[, got %f", ch, p->start);
+      return errStr;
+    }
+    break;
   default:
     snprintf(errStr, sizeof(errStr), "channel[%d]: invalid channel parameter type, got %d", ch, p->type);
     return errStr;
@@ -133,107 +152,220 @@ char* checkParams(int ch, cmdParams_t *p) {
   return NULL;
 }
 
-void convertParams(volatile genParams_t *g, cmdParams_t *p){
-  double pulsePerSeconds = frequencyMean, pulsePerPeriod;
-  if(pulsePerSeconds == 0)
-    pulsePerSeconds = 10.; // measure on raspberry PI4
+// convertParams converts the parameters p of channel ch into the 
+// generator parameters g. The parameters must be valid.
+void convertParams(int ch, genParams_t *g, cmdParams_t *p){
+  bzero(g, sizeof(*g));
   switch(p->type) {
   case CST_PARAM:
-    g->a = g->dy = g->x = g->y = g->c = g->s = 0;
     g->y0 = p->average;
     break;
   case SIN_PARAM:
-    g->a = g->dy = 0;
-    pulsePerPeriod = pulsePerSeconds*p->period;
-    g->y0 = p->average;
-    double angleStep = 2*PI/pulsePerPeriod;
-    g->c = cos(angleStep);
-    g->s = sin(angleStep);
-    double angle0 = 2*PI*p->start;
-    g->x = cos(angle0)*p->amplitude;
-    g->y = sin(angle0)*p->amplitude;
-    break;
   case TRI_PARAM:
-    g->x = g->c = g->s = 0;
-    pulsePerPeriod = pulsePerSeconds*p->period;
     g->y0 = p->average;
     g->a = p->amplitude;
-    g->dy = p->amplitude*4/pulsePerPeriod;
-    if(p->start < 0.25) {
-      g->y = g->dy*pulsePerPeriod*p->start;
-    } else if(p->start < 0.75) {
-      g->dy = -g->dy;
-      g->y = g->a - g->dy*(p->start-0.25)*pulsePerPeriod;
-    } else {
-      g->y = -g->a - g->dy*(p->start-0.75)*pulsePerPeriod;
-    }
+    g->tri = p->type == TRI_PARAM;
+    // a start of 1-e might be rounded to 2^32 which is a full period
+    g->phase = (uint64_t)(p->start*4294967296.) << 32;
+    double freq = 18446744073709551616./(p->period*1e9);
+    g->freq = freq < 9.2e18 ? (uint64_t)freq : (uint64_t)9.2e18;
     break;
+  case ARB_PARAM:
+    g->tbl = arbTables[ch][arbUpload[ch]];
+    g->len = arbLen[ch][arbUpload[ch]];
+    g->loop = p->amplitude != 0;
+    g->pos = (uint64_t)(p->start*g->len*(double)((uint64_t)1 << ARB_FRAC_BITS));
+    g->step = (uint64_t)(p->average*(double)((uint64_t)1 << ARB_FRAC_BITS)/1e9 + .5);
+    arbPlay[ch] = arbUpload[ch];
+    break;
+  }
+}
+
+const char *TYPE[] = {"CST", "SIN", "TRI", "ARB"};
+
+// beginParamsUpdate must be called before modifying cmdParams, and 
+// endParamsUpdate after, so that snapshotParams never returns a mix of
+// old and new parameters. The generator may modify cmdParams when it
+// applies a timed parameter set, so beginParamsUpdate waits until it is
+// done.
+static void beginParamsUpdate() {
+  unsigned seq;
+  do {
+    seq = atomic_load_explicit(&cmdParamsSeq, memory_order_relaxed) & ~1u;
+  } while(!atomic_compare_exchange_weak_explicit(&cmdParamsSeq, &seq, seq+1, 
+            memory_order_relaxed, memory_order_relaxed));
+  atomic_thread_fence(memory_order_release);
+}
+
+static void endParamsUpdate() {
+  atomic_fetch_add_explicit(&cmdParamsSeq, 1, memory_order_release);
+}
+
+// storeTimedParams is the timedHook storing in cmdParams the command 
+// parameters of the timed set in slot when the generator applies it. 
+// It returns false without waiting when cmdParams is being modified, and
+// the generator retries later. The channels whose parameters were 
+// published after the set in slot was applied are skipped, since the 
+// generator applies them after it.
+static bool storeTimedParams(int slot, uint32_t after) {
+  unsigned seq = atomic_load_explicit(&cmdParamsSeq, memory_order_relaxed);
+  if((seq & 1) != 0 || !atomic_compare_exchange_strong_explicit(&cmdParamsSeq, &seq, seq+1, 
+                          memory_order_acquire, memory_order_relaxed))
+    return false;
+  atomic_thread_fence(memory_order_release);
+  for(uint32_t m = timedFlags[slot]; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    if((int32_t)(cmdParamsPub[ch] - after) <= 0)
+      cmdParams[ch] = timedCmdParams[slot][ch];
+  }
+  endParamsUpdate();
+  return true;
+}
+
+// snapshotParams copies the current parameters of the channels in p. It 
+// may be called by any thread and never blocks the command handler.
+void snapshotParams(cmdParams_t p[MAX_CHAN]) {
+  unsigned seq0, seq1;
+  do {
+    seq0 = atomic_load_explicit(&cmdParamsSeq, memory_order_acquire);
+    memcpy(p, cmdParams, sizeof(cmdParams));
+    atomic_thread_fence(memory_order_acquire);
+    seq1 = atomic_load_explicit(&cmdParamsSeq, memory_order_relaxed);
+  } while((seq0 & 1) != 0 || seq0 != seq1);
+}
+
+// setParams checks the validity of the new parameters of the channels
+// flagged in hasCmdParams. If they are all valid, it stores them and
+// passes them to the generator to be applied in the same pwm period,
+// and returns NULL. Otherwise it returns the error message.
+char* setParams(cmdParams_t newCmdParams[MAX_CHAN], const bool hasCmdParams[MAX_CHAN]) {
+  // check parameter validity
+  for(int ch = 0; ch < nChan; ch++) {
+    if(!hasCmdParams[ch])
+      continue;
+    char *err = checkParams(ch, newCmdParams+ch);
+    if(err != NULL)
+      return err;
+  }
+  // store new command parameters
+  beginParamsUpdate();
+  for(int ch = 0; ch < nChan; ch++) {
+    if(hasCmdParams[ch]) {
+      cmdParams[ch] = newCmdParams[ch];
+      cmdParamsPub[ch] = paramsSeq+1;
+    }
+  }
+  endParamsUpdate();
+
+  // convert parameters and pass it to generator
+  genParams_t newParams[MAX_CHAN];
+  uint32_t flag = 0;
+  for(int ch = 0; ch < nChan; ch++) {
+    if(!hasCmdParams[ch])
+      continue;
+    convertParams(ch, newParams+ch, newCmdParams+ch);
+    flag |= 1 << ch; 
+  }
+  publishParams(newParams, flag);
+  return NULL;
+}
+
+// setTimedParams checks the validity of the new parameters of the channels
+// flagged in hasCmdParams. If they are all valid, it queues them to be 
+// applied by the generator in the first pwm period starting at or after 
+// time, in CLOCK_REALTIME seconds, and returns NULL. Otherwise it returns 
+// the error message. When sync is true, a synchronized start is armed at 
+// time so that the parameters are applied in a period starting at time.
+char* setTimedParams(double time, cmdParams_t newCmdParams[MAX_CHAN], const bool hasCmdParams[MAX_CHAN], bool sync) {
+  if(!(time > 0 && time < 1.8e10)) {
+    snprintf(errStr, sizeof(errStr), "expect time to be in the range ]0,1.8e10[, got %f", time);
+    return errStr;
+  }
+  for(int ch = 0; ch < nChan; ch++) {
+    if(!hasCmdParams[ch])
+      continue;
+    char *err = checkParams(ch, newCmdParams+ch);
+    if(err != NULL)
+      return err;
+  }
+  int slot = timedSlot();
+  if(slot < 0) {
+    snprintf(errStr, sizeof(errStr), "expect at most %d queued timed parameter sets", TIMED_SIZE);
+    return errStr;
+  }
+  // the synchronized start is armed before the parameters are queued so 
+  // that they can't be applied in an earlier period
+  if(sync && armSync((uint64_t)(time*1e9 + .5)) < 0) {
+    snprintf(errStr, sizeof(errStr), "a synchronized start is already armed");
+    return errStr;
   }
+  genParams_t newParams[MAX_CHAN];
+  uint32_t flag = 0, arb = 0;
+  for(int ch = 0; ch < nChan; ch++) {
+    if(!hasCmdParams[ch])
+      continue;
+    convertParams(ch, newParams+ch, newCmdParams+ch);
+    flag |= 1 << ch;
+    if(newCmdParams[ch].type == ARB_PARAM)
+      arb |= 1 << ch;
+  }
+  memcpy(timedCmdParams[slot], newCmdParams, sizeof(timedCmdParams[slot]));
+  timedFlags[slot] = flag;
+  timedArb[slot] = arb;
+  publishTimedParams(slot, (uint64_t)(time*1e9 + .5), newParams, flag);
+  return NULL;
 }
 
-const char *TYPE[] = {"CST", "SIN", "TRI"};
+// formatParams writes the GPRM response text of the parameters p in buf.
+// Returns the text length, or -1 if buf is too small.
+int formatParams(char *buf, int len, const cmdParams_t p[MAX_CHAN]) {
+  int n = snprintf(buf, len, "%d", nChan);
+  for(int ch = 0; ch < nChan && n < len; ch++)
+    n += snprintf(buf+n, len-n, ", %d %s %g %g %g %g", ch, TYPE[p[ch].type], p[ch].average, p[ch].amplitude, p[ch].period, p[ch].start); 
+  return n < len ? n : -1;
+}
 
 // requestGetParams handles a getParams (GPRM) request. It has no
 // arguments, 
 int requestGetParams(char *beg, char *end) {
   if(beg == end || *beg != '\n')
     return sendError(&conn, "unexpected data after \"GPRM\"");
-  char buf[65536], *p = buf;
-  ssize_t len = sizeof(buf);
-  ssize_t n = snprintf(p, len, "%d", NCHAN);
-  if(n >= len) {
-      printErr("requestGetParams: output truncated\n");
-    return n;
-  }
-  p += n;
-  len -= n;
-  for(int ch = 0; ch < NCHAN; ch++) {
-    n = snprintf(p, len, ", %d %s %g %g %g %g", ch, TYPE[cmdParams[ch].type], cmdParams[ch].average, cmdParams[ch].amplitude, cmdParams[ch].period, cmdParams[ch].start); 
-    if(n >= len) {
-      printErr("requestGetParams: output truncated\n");
-      return n;
-    }
-    p += n;
-    len -= n;
+  char buf[BUFFER_SIZE];
+  cmdParams_t p[MAX_CHAN];
+  snapshotParams(p);
+  if(formatParams(buf, sizeof(buf), p) < 0) {
+    printErr("requestGetParams: output truncated\n");
+    return -2;
   }
   //print("debug: sendRsp: %s\n", buf);
-  return sendRsp(&conn, buf);
+  return sendRsp(&conn, "%s", buf);
 }
 
-int requestSetParams(char *beg, char *end) {
-  if(beg == end) {
-    return sendError(&conn, "expected arguments to \"SPRM\"");
-  }
-  end--;
-  cmdParams_t newCmdParams[NCHAN];
-  bool hasCmdParams[NCHAN];
-  bzero(newCmdParams, sizeof(newCmdParams));
-  bzero(hasCmdParams, sizeof(hasCmdParams));
-  // decode parameters
+// parseParams decodes the channel parameters of a SPRM or TPRM request 
+// in newCmdParams and flags them in hasCmdParams. end points to the
+// newline. The fields missing at the end of a channel are 0. It returns
+// NULL if it succeeds, or the error message.
+static char* parseParams(char *beg, char *end, cmdParams_t newCmdParams[MAX_CHAN], bool hasCmdParams[MAX_CHAN]) {
+  bzero(newCmdParams, MAX_CHAN*sizeof(newCmdParams[0]));
+  bzero(hasCmdParams, MAX_CHAN*sizeof(hasCmdParams[0]));
   int nParams = 0;
-  char *p = beg;
-  int len = end-beg, consumed;
-  int n = sscanf(p, "%d%n", &nParams, &consumed);
-  if(n <= 0) {
-    printErr("requestSetParams: failed parsing \"%.*s\" (%d)\n", len, beg, n);
-    return sendError(&conn, "invalid arguments");
+  char *p = parseInt(beg, end, &nParams);
+  if(p == NULL) {
+    printWarn("parseParams: failed parsing \"%.*s\"\n", (int)(end-beg), beg);
+    return "invalid arguments";
   }
-  p += consumed;
-  len -= consumed;
   for(int i = 0; i < nParams; i++) {
     int ch = -1;
     char type[4] = "";
-    double average = 0, amplitude = 0, period = 0, start = 0;
-    n = sscanf(p, ", %d %3s %lg %lg %lg %lg%n", &ch, type, &average, &amplitude, &period, &start, &consumed);
+    double v[4] = {0, 0, 0, 0};
+    int n = parseChannel(p, end, &ch, type, v, &p);
     if(n <= 0) {
-      printErr("requestSetParams: failed parsing \"%.*s\" (%d)\n", (int)(end-beg)-1, beg, n);
-      return sendError(&conn, "invalid arguments");
+      printWarn("parseParams: failed parsing \"%.*s\" (%d)\n", (int)(end-beg), beg, n);
+      return "invalid arguments";
     }
-    p += consumed;
-    len -= consumed;
-    if(ch < 0 || ch >= NCHAN) {
-      printErr("requestSetParams: invalid channel %d\n", ch);
-      return sendError(&conn, "channel number out of range");
+    if(ch < 0 || ch >= nChan) {
+      printWarn("parseParams: invalid channel %d\n", ch);
+      return "channel number out of range";
     }
     if(strcmp(type, "CST") == 0)
       newCmdParams[ch].type = 0;
@@ -241,88 +373,361 @@ int requestSetParams(char *beg, char *end) {
       newCmdParams[ch].type = 1;
     else if(strcmp(type, "TRI") == 0)
       newCmdParams[ch].type = 2;
+    else if(strcmp(type, "ARB") == 0)
+      newCmdParams[ch].type = 3;
     else {
-      printErr("requestSetParams: channel %d assigned invalid type %s\n", ch, type);
-      return sendError(&conn, "channel %d assigned invalid type %s", ch, type);
+      printWarn("parseParams: channel %d assigned invalid type %s\n", ch, type);
+      snprintf(errStr, sizeof(errStr), "channel %d assigned invalid type %s", ch, type);
+      return errStr;
     }
     hasCmdParams[ch] = true;
-    newCmdParams[ch].average = average;
-    newCmdParams[ch].amplitude = amplitude;
-    newCmdParams[ch].period = period;
-    newCmdParams[ch].start = start;
+    newCmdParams[ch].average = v[0];
+    newCmdParams[ch].amplitude = v[1];
+    newCmdParams[ch].period = v[2];
+    newCmdParams[ch].start = v[3];
   }
-  // check parameter validity
-  for(int ch = 0; ch < NCHAN; ch++) {
-    if(!hasCmdParams[ch])
-      continue;
-    char *err = checkParams(ch, newCmdParams+ch);
-    if(err != NULL) {
-      printErr("requestSetParams: error: %s\n", err);
-      return sendError(&conn, err);
-    }
+  return NULL;
+}
+
+int requestSetParams(char *beg, char *end) {
+  if(beg == end) {
+    return sendError(&conn, "expected arguments to \"SPRM\"");
   }
-  // store new command parameters
-  for(int ch = 0; ch < NCHAN; ch++)
-    if(hasCmdParams[ch])
-      cmdParams[ch] = newCmdParams[ch];
+  cmdParams_t newCmdParams[MAX_CHAN];
+  bool hasCmdParams[MAX_CHAN];
+  char *err = parseParams(beg, end-1, newCmdParams, hasCmdParams);
+  if(err == NULL)
+    err = setParams(newCmdParams, hasCmdParams);
+  if(err != NULL) {
+    printWarn("requestSetParams: error: %s\n", err);
+    return sendError(&conn, "%s", err);
+  }
+  return sendRsp(&conn, "DONE");
+}
 
-  // convert parameters and pass it to generator
-  while(atomic_flag_test_and_set(&newParamsLock));
-  uint16_t flag = 0;
-  for(int ch = 0; ch < NCHAN; ch++) {
-    if(!hasCmdParams[ch])
-      continue;
-    convertParams(newParams+ch, cmdParams+ch);
-    flag |= 1 << ch; 
+// requestTimedParams handles a timed set params (TPRM) request, or a
+// synchronized start (SYNC) request when sync is true. The first argument
+// is the CLOCK_REALTIME time in seconds at which the parameters must be 
+// applied. It is followed by the parameters as for SPRM.
+int requestTimedParams(char *beg, char *end, bool sync) {
+  if(beg == end) {
+    return sendError(&conn, "expected arguments to \"%s\"", sync ? "SYNC" : "TPRM");
+  }
+  double time;
+  char *p = parseDouble(beg, end-1, &time);
+  if(p == NULL) {
+    printWarn("requestTimedParams: failed parsing \"%.*s\"\n", (int)(end-beg)-1, beg);
+    return sendError(&conn, "invalid arguments");
+  }
+  cmdParams_t newCmdParams[MAX_CHAN];
+  bool hasCmdParams[MAX_CHAN];
+  char *err = parseParams(p, end-1, newCmdParams, hasCmdParams);
+  if(err == NULL)
+    err = setTimedParams(time, newCmdParams, hasCmdParams, sync);
+  if(err != NULL) {
+    printWarn("requestTimedParams: error: %s\n", err);
+    return sendError(&conn, "%s", err);
   }
-  newParamFlags = flag;
-  atomic_flag_clear(&newParamsLock);
   return sendRsp(&conn, "DONE");
 }
 
+// requestSyncStatus handles a synchronized start status (SYNE) request.
+// It has no arguments. The response is the state (0 = none, 1 = armed, 
+// 2 = started), the time in CLOCK_REALTIME seconds and the start error
+// in ns of the last synchronized start.
+int requestSyncStatus(char *beg, char *end) {
+  if(beg == end || *beg != '\n')
+    return sendError(&conn, "unexpected data after \"SYNE\"");
+  uint64_t time;
+  int64_t error;
+  int state = syncStatus(&time, &error);
+  return sendRsp(&conn, "%d %llu.%09llu %lld", state, (unsigned long long)(time/1000000000), 
+    (unsigned long long)(time%1000000000), (long long)error);
+}
+
+// requestSetTable handles a set table (STBL) request uploading the samples
+// of the arbitrary variation of a channel. The arguments are the channel,
+// the offset of the first sample and the number of samples, followed by
+// the samples. An offset of 0 starts a new table, otherwise the samples 
+// are appended to the table being uploaded.
+int requestSetTable(char *beg, char *end) {
+  if(beg == end) {
+    return sendError(&conn, "expected arguments to \"STBL\"");
+  }
+  int ch = -1, offset = -1, nSamples = -1;
+  char *p = parseInt(beg, end-1, &ch);
+  if(p != NULL)
+    p = parseInt(p, end-1, &offset);
+  if(p != NULL)
+    p = parseInt(p, end-1, &nSamples);
+  if(p == NULL) {
+    printWarn("requestSetTable: failed parsing \"%.*s\"\n", (int)(end-beg)-1, beg);
+    return sendError(&conn, "invalid arguments");
+  }
+  if(ch < 0 || ch >= nChan) {
+    printWarn("requestSetTable: invalid channel %d\n", ch);
+    return sendError(&conn, "channel number out of range");
+  }
+  int bank = offset == 0 ? 1 - arbPlay[ch] : arbUpload[ch];
+  if(offset < 0 || (offset != 0 && offset != (int)arbLen[ch][bank])) {
+    printWarn("requestSetTable: channel %d invalid offset %d\n", ch, offset);
+    return sendError(&conn, "expect offset to be 0 or %u, got %d", arbLen[ch][bank], offset);
+  }
+  if(nSamples <= 0 || offset+nSamples > ARB_MAX_SAMPLES) {
+    printWarn("requestSetTable: channel %d invalid number of samples %d\n", ch, nSamples);
+    return sendError(&conn, "expect number of samples to be in the range [1,%d], got %d", ARB_MAX_SAMPLES-offset, nSamples);
+  }
+  uint16_t samples[ARB_MAX_SAMPLES];
+  for(int i = 0; i < nSamples; i++) {
+    double val;
+    char *e = parseDouble(p, end-1, &val);
+    if(e == NULL) {
+      printWarn("requestSetTable: channel %d failed parsing sample %d\n", ch, i);
+      return sendError(&conn, "invalid arguments");
+    }
+    if(!(val >= 0 && val <= 1)) {
+      printWarn("requestSetTable: channel %d invalid sample %d\n", ch, i);
+      return sendError(&conn, "expect sample %d to be in the range [0,1], got %f", i, val);
+    }
+    samples[i] = (uint16_t)(val*65535+.5);
+    p = e;
+  }
+  while(*p == ' ')
+    p++;
+  if(p+1 != end) {
+    printWarn("requestSetTable: unexpected data after %d samples\n", nSamples);
+    return sendError(&conn, "unexpected data after %d samples", nSamples);
+  }
+  for(uint64_t m = timedQueued(); offset == 0 && m != 0; m &= m-1) {
+    if(timedArb[__builtin_ctzll(m)] & (1 << ch)) {
+      printWarn("requestSetTable: channel %d has a queued timed arbitrary variation\n", ch);
+      return sendError(&conn, "channel %d has a queued timed arbitrary variation", ch);
+    }
+  }
+  if(offset == 0) {
+    // the generator may still play the bank if it didn't yet consume the 
+    // parameters of the last arbitrary variation published on the other.
+    waitParams();
+    arbUpload[ch] = bank;
+  }
+  memcpy(arbTables[ch][bank]+offset, samples, nSamples*sizeof(samples[0]));
+  arbLen[ch][bank] = offset+nSamples;
+  return sendRsp(&conn, "DONE");
+}
+
+// requestStream handles a stream (STRM) request. The arguments are the
+// number of channels followed by the channel numbers. The connection
+// then switches to binary frames of fixed size. A frame starts with 
+// 'F' followed by the pwm values of the channels encoded as 16 bit 
+// little endian unsigned integers (65535 = 1). A frame starting with 
+// 'E' ends the stream. The streamed channels are then set to CST with 
+// their last value, also when the connection is closed during the 
+// stream. The response to the end of stream is the number of frames 
+// received, and the number of underruns and overruns.
+int requestStream(char *beg, char *end) {
+  if(beg == end) {
+    return sendError(&conn, "expected arguments to \"STRM\"");
+  }
+  int chans[MAX_CHAN], nChans = 0;
+  uint32_t mask = 0;
+  char *p = parseInt(beg, end-1, &nChans);
+  if(p == NULL || nChans <= 0 || nChans > nChan) {
+    printWarn("requestStream: failed parsing \"%.*s\"\n", (int)(end-beg)-1, beg);
+    return sendError(&conn, "invalid arguments");
+  }
+  for(int i = 0; i < nChans; i++) {
+    int ch;
+    if((p = parseInt(p, end-1, &ch)) == NULL) {
+      printWarn("requestStream: failed parsing \"%.*s\"\n", (int)(end-beg)-1, beg);
+      return sendError(&conn, "invalid arguments");
+    }
+    if(ch < 0 || ch >= nChan || (mask & (1 << ch))) {
+      printWarn("requestStream: invalid channel %d\n", ch);
+      return sendError(&conn, "channel number out of range or duplicate");
+    }
+    mask |= 1 << ch;
+    chans[i] = ch;
+  }
+  while(*p == ' ')
+    p++;
+  if(p+1 != end) {
+    printWarn("requestStream: unexpected data after %d channels\n", nChans);
+    return sendError(&conn, "unexpected data after %d channels", nChans);
+  }
+  int res = sendRsp(&conn, "DONE");
+  if(res <= 0)
+    return res;
+  streamStart();
+  frame_t f = {.mask = mask}, last = f;
+  uint64_t frames = 0;
+  int frameLen = 1 + 2*nChans;
+  while(1) {
+    if((res = recvBuf(&conn, frameLen)) <= 0)
+      break;
+    uint8_t *b = (uint8_t*)conn.msg;
+    if(b[0] != 'F')
+      break;
+    for(int i = 0; i < nChans; i++)
+      f.duty[chans[i]] = b[1+2*i] | (b[2+2*i] << 8);
+    if(streamPush(&f) == 0)
+      last = f;
+    frames++;
+  }
+  if(frames != 0) {
+    // hold the last values pushed in the ring when the stream is released
+    genParams_t newParams[MAX_CHAN];
+    beginParamsUpdate();
+    for(int i = 0; i < nChans; i++) {
+      int ch = chans[i];
+      bzero(cmdParams+ch, sizeof(cmdParams[ch]));
+      cmdParams[ch].average = last.duty[ch]/65535.;
+      cmdParamsPub[ch] = paramsSeq+1;
+      convertParams(ch, newParams+ch, cmdParams+ch);
+    }
+    endParamsUpdate();
+    publishParams(newParams, mask);
+    waitParams();
+  }
+  streamStop();
+  if(res <= 0)
+    return res;
+  if(conn.msg[0] != 'E') {
+    printWarn("requestStream: invalid frame tag 0x%02X\n", (uint8_t)conn.msg[0]);
+    return sendError(&conn, "invalid stream frame tag 0x%02X", (uint8_t)conn.msg[0]);
+  }
+  return sendRsp(&conn, "%llu %llu %llu", (unsigned long long)frames, 
+    (unsigned long long)atomic_load(&streamUnderruns), (unsigned long long)atomic_load(&streamOverruns));
+}
+
+// requestFrequency handles a frequency (FREQ) request. It has no 
+// arguments. It never waits for a measure, the mean is 0 until the 
+// generator published its first statistics.
 int requestFrequency(char *beg, char *end) {
   if(beg == end || *beg != '\n')
     return sendError(&conn, "unexpected data after \"FREQ\"\n");
-  for(int i = 0; i < 4 && frequencyMean == 0; i++)
-    sleep(1);
-  return sendRsp(&conn, "%g %g", frequencyMean, sqrt(frequencyVariance));
+  double mean, stdDev;
+  generatorFrequency(&mean, &stdDev);
+  return sendRsp(&conn, "%g %g", mean, stdDev);
+}
+
+// formatTelemetry writes the telemetry line pushed to the subscribers in
+// buf, without its '*' tag: the mean frequency and its standard deviation,
+// the number of skipped periods, of missed steps, of stream underruns and
+// overruns, followed by the parameters as in the GPRM response. The 
+// statistics are copied in s, provided by the caller since it is big. 
+// Returns the text length, or -1 if buf is too small.
+int formatTelemetry(char *buf, int len, stats_t *s) {
+  double mean, stdDev;
+  cmdParams_t p[MAX_CHAN];
+  statsSnapshot(s);
+  generatorFrequency(&mean, &stdDev);
+  snapshotParams(p);
+  int n = snprintf(buf, len, "%g %g %llu %llu %llu %llu ", mean, stdDev, 
+    (unsigned long long)s->skippedPeriods, (unsigned long long)s->missedSteps,
+    (unsigned long long)atomic_load(&streamUnderruns), (unsigned long long)atomic_load(&streamOverruns));
+  if(n >= len)
+    return -1;
+  int m = formatParams(buf+n, len-n, p);
+  return m < 0 ? -1 : n+m;
+}
+
+// requestSubscribe handles a telemetry subscription (SUBS) request. Its
+// argument is the interval in ms between the pushed telemetry lines, or
+// 0 to stop the pushes.
+int requestSubscribe(char *beg, char *end) {
+  int ms;
+  char *p = parseInt(beg, end-1, &ms);
+  if(p != end-1 || (ms != 0 && (ms < SUBS_MIN_INTERVAL || ms > SUBS_MAX_INTERVAL))) {
+    printWarn("requestSubscribe: failed parsing \"%.*s\"\n", (int)(end-beg)-1, beg);
+    return sendError(&conn, "expect an interval of 0 or %d to %d ms", SUBS_MIN_INTERVAL, SUBS_MAX_INTERVAL);
+  }
+  if(subscribe(&conn, ms) < 0)
+    return sendError(&conn, "failed arming the telemetry timer");
+  return sendRsp(&conn, "DONE");
+}
+
+// requestStats handles a statistics (STAT) request. It has no arguments.
+int requestStats(char *beg, char *end) {
+  if(beg == end || *beg != '\n')
+    return sendError(&conn, "unexpected data after \"STAT\"\n");
+  static stats_t s;
+  char buf[256];
+  statsSnapshot(&s);
+  if(formatStats(buf, sizeof(buf), &s) < 0)
+    return -2;
+  return sendRsp(&conn, "%s", buf);
+}
+
+// startGenerator resets the parameter sets and the stream, and starts
+// the generator for a new controller. The controller must have set
+// isConnected.
+void startGenerator() {
+  resetParams();
+  streamReset();
+  timedHook = storeTimedParams;
+  atomic_store(&generatorRunning, true);
+  if(startPinnedThread(3, &generator) < 0)
+    atomic_store(&generatorRunning, false);
+}
+
+// stopGenerator stops the generator and waits until it stopped. The
+// controller must then clear isConnected.
+void stopGenerator() {
+  publishParams(NULL, PARAMS_STOP);
+  while(atomic_load(&generatorRunning))
+    usleep(1000);
 }
 
 // command handler thread
 void* commandHandler(void* dummy) {
   UNUSED(dummy);
   //print("command info: started\n");
-  newParamFlags = 0;
-  startPinnedThread(3, &generator);
+  startGenerator();
   int res;
   print("start accepting commands from %s\n", conn.addrStr);
   do {
+    if(conn.proto == PROTO_BINARY) {
+      res = binaryRequest();
+      continue;
+    }
     //print("debug: commandHandler: wait for a request\n");
     if((res = recvReq(&conn)) <= 0)
       break;
     if(res < 5) {
-      printErr("command warning: received invalid request \"%.*s\" from %s\n", res, conn.req, conn.addrStr);
-      res = sendError(&conn, "invalid request \"%.*s\"", res, conn.req);
+      printWarn("command warning: received invalid request \"%.*s\" from %s\n", res, conn.msg, conn.addrStr);
+      res = sendError(&conn, "invalid request \"%.*s\"", res, conn.msg);
       continue;
     }
-    char *end = conn.req+res;
-    if(memcmp(conn.req, "GPRM", 4) == 0) {
-      res = requestGetParams(conn.req+4, end);
-    } else if(memcmp(conn.req, "SPRM ", 5) == 0) {
-      res = requestSetParams(conn.req+5, end);
-    } else if(memcmp(conn.req, "FREQ", 4) == 0) {
-      res = requestFrequency(conn.req+4, end);
+    char *end = conn.msg+res;
+    if(memcmp(conn.msg, "GPRM", 4) == 0) {
+      res = requestGetParams(conn.msg+4, end);
+    } else if(memcmp(conn.msg, "SPRM ", 5) == 0) {
+      res = requestSetParams(conn.msg+5, end);
+    } else if(memcmp(conn.msg, "TPRM ", 5) == 0) {
+      res = requestTimedParams(conn.msg+5, end, false);
+    } else if(memcmp(conn.msg, "SYNC ", 5) == 0) {
+      res = requestTimedParams(conn.msg+5, end, true);
+    } else if(memcmp(conn.msg, "SYNE", 4) == 0) {
+      res = requestSyncStatus(conn.msg+4, end);
+    } else if(memcmp(conn.msg, "STBL ", 5) == 0) {
+      res = requestSetTable(conn.msg+5, end);
+    } else if(memcmp(conn.msg, "STRM ", 5) == 0) {
+      res = requestStream(conn.msg+5, end);
+    } else if(memcmp(conn.msg, "FREQ", 4) == 0) {
+      res = requestFrequency(conn.msg+4, end);
+    } else if(memcmp(conn.msg, "STAT", 4) == 0) {
+      res = requestStats(conn.msg+4, end);
+    } else if(memcmp(conn.msg, "SUBS ", 5) == 0) {
+      res = requestSubscribe(conn.msg+5, end);
     } else {
-      printErr("command warning: received undefined request \"%.*s\" from %s\n", res, conn.req, conn.addrStr);
-      res = sendError(&conn, "undefined request \"%.*s\"", res-1, conn.req);
+      printWarn("command warning: received undefined request \"%.*s\" from %s\n", res, conn.msg, conn.addrStr);
+      res = sendError(&conn, "undefined request \"%.*s\"", res-1, conn.msg);
     }
   } while(res > 0);
   print("stop accepting commands from %s\n", conn.addrStr);
   closeConn(&conn);
   //print("command info: stopping generator...\n");
-  while(atomic_flag_test_and_set(&newParamsLock));
-  newParamFlags = 1 << NCHAN; // request to stop flag
-  atomic_flag_clear(&newParamsLock);
+  stopGenerator();
   //print("command info: stopped\n");
   atomic_flag_clear(&isConnected);
   return NULL;
@@ -1,8 +1,88 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+#include "gpio.h"
+#include "generator.h"
+#include "stats.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// cmdParams hols the user provided parameters. The type is specify the 
+// type of generation: 0 = cst, 1 = sinusoidal, 2 = triangular. When cst,
+// only the average must be provided, all other values mist be 0.
+// When sinusoidal, the amplitude must be different from 0, and 
+// amplitude+average <= 1 and average-amplitude >= 0. The start is a 
+// value in the range [0,1] and specifies the advance in the period
+// at the start of generation.
+// When triangular, it is the same as for sinusoidal except that the
+// generated signal will be triangular.
+// When arbitrary, the samples uploaded for the channel are played. The
+// fields are then the playback rate in samples per second (average), 
+// 1 to play in loop or 0 to hold the last sample (amplitude), the number
+// of samples (period) and the start position as a fraction of the
+// samples (start).
+
+#define CST_PARAM 0
+#define SIN_PARAM 1
+#define TRI_PARAM 2
+#define ARB_PARAM 3
+
+typedef struct {
+  uint8_t type;     // type of generation: 0 = cst, 1 = sinusoidal, 2 = triangular, 3 = arbitrary
+  double average;   // value in the range [0,1]
+  double amplitude; // amplitude of variation 
+  double period;    // duration in seconds of one period
+  double start;     // start in percentage of period range [0,1]
+} cmdParams_t;
+
 
 extern char *version;
+extern cmdParams_t cmdParams[MAX_CHAN]; // current parameters of the channels
+extern const char *TYPE[];              // names of the parameter types
+
+// convertParams converts the parameters p of channel ch into the 
+// generator parameters g. The parameters must be valid.
+void convertParams(int ch, genParams_t *g, cmdParams_t *p);
+
+// setParams checks the validity of the new parameters of the channels
+// flagged in hasCmdParams. If they are all valid, it stores them and
+// passes them to the generator to be applied in the same pwm period,
+// and returns NULL. Otherwise it returns the error message.
+char* setParams(cmdParams_t newCmdParams[MAX_CHAN], const bool hasCmdParams[MAX_CHAN]);
+
+// setTimedParams checks the validity of the new parameters of the channels
+// flagged in hasCmdParams. If they are all valid, it queues them to be 
+// applied by the generator in the first pwm period starting at or after 
+// time, in CLOCK_REALTIME seconds, and returns NULL. Otherwise it returns 
+// the error message. When sync is true, a synchronized start is armed at 
+// time so that the parameters are applied in a period starting at time.
+char* setTimedParams(double time, cmdParams_t newCmdParams[MAX_CHAN], const bool hasCmdParams[MAX_CHAN], bool sync);
+
+// snapshotParams copies the current parameters of the channels in p. It 
+// may be called by any thread and never blocks the command handler.
+void snapshotParams(cmdParams_t p[MAX_CHAN]);
+
+// formatParams writes the GPRM response text of the parameters p in buf.
+// Returns the text length, or -1 if buf is too small.
+int formatParams(char *buf, int len, const cmdParams_t p[MAX_CHAN]);
+
+// formatTelemetry writes the telemetry line pushed to the subscribers in
+// buf, without its '*' tag: the mean frequency and its standard deviation,
+// the number of skipped periods, of missed steps, of stream underruns and
+// overruns, followed by the parameters as in the GPRM response. The 
+// statistics are copied in s, provided by the caller since it is big. 
+// Returns the text length, or -1 if buf is too small.
+int formatTelemetry(char *buf, int len, stats_t *s);
+
+// startGenerator resets the parameter sets and the stream, and starts
+// the generator for a new controller. The controller must have set
+// isConnected.
+void startGenerator();
+
+// stopGenerator stops the generator and waits until it stopped. The
+// controller must then clear isConnected.
+void stopGenerator();
 
 void* commandHandler(void*);
 
@@ -0,0 +1,93 @@
+// Differential fuzz harness of the request parser. It decodes the input
+// as the parameters of a channel of a SPRM request, and as the time of a
+// TPRM request, with the parser and with the sscanf calls it replaces,
+// and aborts when the results differ.
+//
+// libFuzzer, from the repository root:
+//   clang -I. -g -O1 -fsanitize=fuzzer,address,undefined fuzz/fuzz.c parse.c -o pwmfuzz
+//   ./pwmfuzz -max_len=127 fuzz/corpus
+//
+// AFL, or replaying inputs given as arguments:
+//   afl-clang-fast -I. -O2 -DFUZZ_MAIN fuzz/fuzz.c parse.c -o pwmfuzz
+//   afl-fuzz -i fuzz/corpus -o findings ./pwmfuzz
+
+#include "parse.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_INPUT 127 // longer inputs are ignored so that a token fits in the parser copy
+
+// sameDouble returns true when a and b are the same value, nan included.
+static int sameDouble(double a, double b) {
+  return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// check aborts with the input when cond is false.
+static void check(int cond, const char *what, const char *in) {
+  if(cond)
+    return;
+  fprintf(stderr, "parser mismatch on %s: \"%s\"\n", what, in);
+  abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if(size > MAX_INPUT)
+    return 0;
+  // sscanf stops at the first nul
+  char in[MAX_INPUT+1];
+  memcpy(in, data, size);
+  in[size] = '\0';
+  char *end = in + strlen(in);
+
+  // channel parameters of SPRM
+  int ch = -1, ch2 = -1, consumed = -1;
+  char type[4] = "", type2[4] = "";
+  double v[4] = {0, 0, 0, 0}, v2[4] = {0, 0, 0, 0};
+  char *next;
+  int n = parseChannel(in, end, &ch, type, v, &next);
+  int n2 = sscanf(in, ", %d %3s %lg %lg %lg %lg%n", &ch2, type2, v2, v2+1, v2+2, v2+3, &consumed);
+  check(n == (n2 < 0 ? 0 : n2), "number of fields", in);
+  if(n >= 1)
+    check(ch == ch2, "channel", in);
+  if(n >= 2)
+    check(strcmp(type, type2) == 0, "type", in);
+  for(int i = 0; i < n-2; i++)
+    check(sameDouble(v[i], v2[i]), "value", in);
+  if(n == 6)
+    check(next-in == consumed, "length", in);
+
+  // time of TPRM
+  double t = 0, t2 = 0;
+  consumed = -1;
+  char *p = parseDouble(in, end, &t);
+  n2 = sscanf(in, "%lg%n", &t2, &consumed);
+  check((p != NULL) == (n2 == 1), "number", in);
+  if(p != NULL) {
+    check(sameDouble(t, t2), "number value", in);
+    check(p-in == consumed, "number length", in);
+  }
+  return 0;
+}
+
+#ifdef FUZZ_MAIN
+// main runs the harness on the files given as arguments, or on stdin.
+int main(int argc, char *argv[]) {
+  uint8_t buf[MAX_INPUT+1];
+  for(int i = 1; i < argc || i == 1; i++) {
+    FILE *f = argc > 1 ? fopen(argv[i], "rb") : stdin;
+    if(f == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    if(f != stdin)
+      fclose(f);
+    LLVMFuzzerTestOneInput(buf, n);
+  }
+  return 0;
+}
+#endif
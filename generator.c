@@ -1,6 +1,10 @@
 #include "generator.h"
 #include "thread.h"
 #include "print.h"
+#include "clock.h"
+#include "wave.h"
+#include "stream.h"
+#include "stats.h"
 
 #include <time.h>
 #include <stdio.h>
@@ -8,132 +12,900 @@
 #include <math.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 
 
-volatile genParams_t newParams[NCHAN];           // new parameters set by main thread
-volatile uint32_t newParamFlags;                 // bit set by main thread for each new params
-atomic_flag newParamsLock = ATOMIC_FLAG_INIT;    // lock protecting newParams access
+// The new parameters are passed from the command handler to the generator
+// with a triple buffer. The command handler fills the back set and swaps 
+// it with the shared set. The generator swaps its front set with the shared
+// set when it holds new parameters. Neither of them ever blocks.
+typedef struct {
+  genParams_t params[MAX_CHAN];                  // new params of the channels set in flags
+  uint32_t flags;                                // bit set for each channel with new params
+  uint32_t seq;                                  // publication number of the newest params of the set
+} paramSet_t;
 
-genParams_t genParams[NCHAN];                    // currently active genParams 
-double alpha = 0.1;                              // coefficient for exponentialy decaying weight (0 < alpha < 1)
+#define PARAMS_NEW 4                             // set in paramsShared when not yet consumed
+
+paramSet_t paramSets[3];                         // triple buffer of parameter sets
+atomic_uint paramsShared;                        // index of the shared set and PARAMS_NEW bit
+unsigned paramsBack;                             // index of the set filled by the command handler
+unsigned paramsFront;                            // index of the set read by the generator
+uint32_t paramsSeq;                              // number of published parameter sets (command handler)
+uint32_t paramsApplied;                          // publication number of the last applied set (generator)
+atomic_bool generatorRunning;                    // true until the generator stopped
+
+wave_t wave;                                     // currently active parameters of all channels
 volatile int gpioReg;
-volatile double frequencyMean;                   // mean frequency with exponentialy decaying weighting
-volatile double frequencyVariance;               // frequency variance with exponentialy decaying weighting
-char stats[16];
-volatile uint64_t dummy; 
+int emitMode = EMIT_EDGE;                        // pwm period emission mode
+int bitsResolution = BITS_RESOLUTION;            // number of bits of the pwm values
+volatile double carrierFrequency = DEFAULT_CARRIER; // target pwm period frequency in Hz
+
+uint64_t periodStart;                            // tick count at the start of the current pwm period
+uint32_t periodFrac;                             // fractional part of periodStart in 1/65536 ticks
+uint64_t stepTicks;                              // duration of a step in 1/65536 ticks
+uint64_t periodBegin;                            // tick count when the current pwm period started
+uint64_t wavePeriod;                             // periodStart of the last waveform computation
+double waveCarry;                                // fraction of ns not yet added to the waveform
+
+// In split mode, the pwm periods are computed by a thread on another core
+// and passed to the generator through a lock free single producer single
+// consumer ring of schedules. The generator then only waits for the edges
+// and writes the gpio registers, so that the periods follow each other 
+// without a gap whatever the cost of the waveforms. The compute thread
+// advances the waveforms by the nominal period duration, and by the time
+// skipped by the generator when it is late.
+typedef struct {
+  schedule_t sched;                              // edge schedule of the pwm period
+  bool stop;                                     // true when the generator must stop
+  bool idle;                                     // true when the pwm values are static
+  uint64_t sync;                                 // CLOCK_REALTIME ns of the synchronized start, 0 if none
+} splitEntry_t;
+
+int computeCore = -1;                            // core of the compute thread, -1 without split mode
+splitEntry_t splitRing[SPLIT_SIZE];              // ring of computed pwm periods
+atomic_uint splitHead;                           // index of the next period to compute
+atomic_uint splitTail;                           // index of the next period to emit
+atomic_uint_fast64_t splitSkipNs;                // ns skipped by the generator, not yet added to the waveforms
+
+// When all outputs are static 0 or 1, the generator writes them once and
+// parks on a futex until new parameters or stream frames are available.
+// When the pwm values are static but some are fractional, the generator
+// sleeps until shortly before each edge deadline instead of spinning.
+atomic_uint parkSeq;                             // incremented at each wake up of the parked threads
+atomic_int parkCount;                            // number of parked generator threads
+bool periodSleep;                                // true when the generator may sleep until the edges
+
+// The timed parameter sets are passed to the generator in a pool of slots.
+// The command handler fills a free slot and sets its bit in timedNew. The
+// generator moves the new slots in timedOrder sorted by time, and frees 
+// them once they were applied and timedHook accepted them. 
+typedef struct {
+  uint64_t time;                                 // CLOCK_REALTIME ns at which the set is applied
+  uint64_t seq;                                  // publication order of the set
+  uint32_t after;                                // paramsApplied when the set was applied (generator)
+  paramSet_t set;                                // new parameters
+} timedSet_t;
+
+#define TIMED_ALL (~(uint64_t)0 >> (64-TIMED_SIZE)) // bits of all the slots
+
+timedSet_t timedSets[TIMED_SIZE];                // pool of timed parameter sets
+atomic_uint_fast64_t timedFree;                  // bit set for each free slot
+atomic_uint_fast64_t timedNew;                   // bit set for each slot not yet queued by the generator
+uint64_t timedSeq;                               // number of published sets (command handler)
+int timedOrder[TIMED_SIZE];                      // queued slots sorted by time (generator)
+int nTimed;                                      // number of queued slots (generator)
+int timedApplied[TIMED_SIZE];                    // applied slots not yet freed, in order (generator)
+int nApplied;                                    // number of applied slots not yet freed (generator)
+bool (*timedHook)(int slot, uint32_t after);     // called when a timed set is applied, may be NULL
+uint64_t computeTime;                            // CLOCK_REALTIME ns of the period computed in split mode
+
+// A synchronized start delays the pwm period containing its time so that
+// it starts at this time. The start error is measured when the period 
+// starts. Combined with a timed parameter set, the outputs of generators 
+// on different hosts with synchronized clocks start together.
+atomic_uint_fast64_t syncTime;                   // CLOCK_REALTIME ns of the armed synchronized start, 0 if none
+atomic_uint_fast64_t syncStarted;                // CLOCK_REALTIME ns of the last synchronized start, 0 if none
+atomic_int_fast64_t syncError;                   // start error in ns of the last synchronized start
+uint64_t periodSync;                             // CLOCK_REALTIME ns of the synchronized start of the period, 0 if none
+uint64_t syncClaimed;                            // syncTime already assigned to a period (computing thread)
 
-#define PAUSE_VALUE 6260
+// The channels with their own carrier are not in the edge schedule of
+// the pwm period. Their edges are generated on their own timeline, and
+// merged with the edges of the schedule by the emission engine. Their pwm
+// value is latched at the start of each of their periods.
+typedef struct {
+  uint64_t stepTicks;                            // duration of a step in 1/65536 ticks
+  uint64_t start;                                // tick count at the start of the next period
+  uint32_t frac;                                 // fractional part of start in 1/65536 ticks
+  uint64_t next;                                 // tick count of the next edge
+  bool fall;                                     // true when the next edge clears the output
+} carrier_t;
 
-uint64_t getTimeStamp() {
+double chanCarrier[MAX_CHAN];                    // carrier frequency of each channel in Hz, 0 for the common carrier
+int chanBits[MAX_CHAN];                          // resolution of each channel in bits, 0 for the common resolution
+uint32_t carrierMask;                            // channels with their own carrier
+uint32_t masterMask;                             // gpio bits of the channels following the common carrier
+carrier_t carriers[MAX_CHAN];                    // edge timeline of the channels with their own carrier (generator)
+
+// carrierConfig sets the carrier frequency and resolution of the channels
+// from a comma separated list of ch=hz or ch=hz/bits. The other channels
+// follow the common carrier. It must be called before starting the 
+// generator. Returns -1 if the list is invalid.
+int carrierConfig(const char *list) {
+  const char *p = list;
+  while(1) {
+    char *end;
+    long ch = strtol(p, &end, 10);
+    if(end == p || *end != '=' || ch < 0 || ch >= nChan) {
+      printErr("generator error: invalid channel in \"%s\"\n", list);
+      return -1;
+    }
+    p = end+1;
+    double hz = strtod(p, &end);
+    if(end == p || !(hz > 0)) {
+      printErr("generator error: invalid carrier frequency in \"%s\"\n", list);
+      return -1;
+    }
+    long bits = 0;
+    if(*end == '/') {
+      p = end+1;
+      bits = strtol(p, &end, 10);
+      if(end == p || bits < MIN_RESOLUTION || bits > MAX_RESOLUTION) {
+        printErr("generator error: invalid resolution in \"%s\"\n", list);
+        return -1;
+      }
+    }
+    chanCarrier[ch] = hz;
+    chanBits[ch] = bits;
+    carrierMask |= 1 << ch;
+    if(*end == '\0')
+      return 0;
+    if(*end != ',') {
+      printErr("generator error: expected ',' in \"%s\"\n", list);
+      return -1;
+    }
+    p = end+1;
+  }
+}
+
+// resetCarriers starts the next period of the channels with their own
+// carrier at the tick count start.
+static void resetCarriers(uint64_t start) {
+  for(uint32_t m = carrierMask; m != 0; m &= m-1) {
+    carrier_t *c = carriers + __builtin_ctz(m);
+    c->start = c->next = start;
+    c->frac = 0;
+    c->fall = false;
+  }
+}
+
+// setStepTicks computes the duration of a step from the carrier
+// frequency and the calibrated tick rate. It is 0 when the carrier 
+// frequency is 0 so that the generator runs as fast as it can. The
+// step durations of the channels with their own carrier are updated too.
+static void setStepTicks() {
+  for(uint32_t m = carrierMask; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    carriers[ch].stepTicks = (uint64_t)(ticksPerNs*1e9/(chanCarrier[ch]*chanMaxValue(ch))*65536 + .5);
+  }
+  double freq = carrierFrequency;
+  if(freq <= 0) {
+    stepTicks = 0;
+    return;
+  }
+  stepTicks = (uint64_t)(ticksPerNs*1e9/(freq*MAX_VALUE)*65536 + .5);
+}
+
+// realtimeNs returns the current CLOCK_REALTIME time in nanoseconds.
+static uint64_t realtimeNs() {
   struct timespec t;
-  if(clock_gettime(CLOCK_MONOTONIC_COARSE, &t) < 0) {
-    printErr("getTimeStamp: %s\n", strerror(errno));
+  clock_gettime(CLOCK_REALTIME, &t);
+  return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+// syncDue returns the time of the armed synchronized start if it is 
+// before the end of the pwm period starting at start and lasting ns 
+// nanoseconds, or 0 otherwise. The times are CLOCK_REALTIME ns. 
+static uint64_t syncDue(uint64_t start, double ns) {
+  uint64_t time = atomic_load_explicit(&syncTime, memory_order_relaxed);
+  if(time == 0 || time == syncClaimed || (int64_t)(time - start) >= ns)
+    return 0;
+  syncClaimed = time;
+  return time;
+}
+
+// syncPeriod delays the start of the pwm period to the time of the synchronized
+// start when the period contains it. time is the CLOCK_REALTIME ns of the
+// synchronized start.
+static void syncPeriod(uint64_t time) {
+  uint64_t now = clockTicks();
+  uint64_t ticks = now + (int64_t)((int64_t)(time - realtimeNs())*ticksPerNs);
+  if((int64_t)(ticks - periodStart) > 0) {
+    periodStart = ticks;
+    periodFrac = 0;
+  }
+  resetCarriers(periodStart);
+  periodSync = time;
+}
+
+// sleepUntil sleeps until SLEEP_MARGIN ns before the deadline when it
+// is far enough.
+static void sleepUntil(uint64_t deadline) {
+  int64_t ns = (int64_t)(deadline - clockTicks())/ticksPerNs - SLEEP_MARGIN;
+  if(ns <= 0)
+    return;
+  struct timespec t = {ns/1000000000, ns%1000000000};
+  clock_nanosleep(CLOCK_MONOTONIC, 0, &t, NULL);
+}
+
+// stepDeadline returns the tick count of the given step of the current
+// pwm period.
+static inline uint64_t stepDeadline(uint32_t step) {
+  return periodStart + (((uint64_t)step*stepTicks + periodFrac) >> 16);
+}
+
+// waitTicks busy waits until the tick count deadline. Deadlines reached
+// late are recorded in the statistics.
+static inline void waitTicks(uint64_t deadline) {
+  int64_t late = clockTicks() - deadline;
+  if(late > 0) {
+    if(stepTicks != 0)
+      statsLate(late/ticksPerNs, (uint64_t)late > stepTicks >> 16);
+    return;
+  }
+  if(periodSleep)
+    sleepUntil(deadline);
+  while((int64_t)(clockTicks() - deadline) < 0);
+}
+
+// waitStep busy waits until the deadline of the given step of the
+// current pwm period.
+static inline void waitStep(uint32_t step) {
+  waitTicks(stepDeadline(step));
+}
+
+// startPeriod waits for the start of the pwm period, and records the
+// duration of the previous period in the statistics, and the start error
+// of a synchronized start.
+static inline void startPeriod() {
+  waitStep(0);
+  if(periodSync != 0) {
+    atomic_store(&syncError, (int64_t)(realtimeNs() - periodSync));
+    atomic_store(&syncStarted, periodSync);
+    atomic_store(&syncTime, 0);
+    periodSync = 0;
+  }
+  uint64_t now = clockTicks();
+  if(periodBegin != 0)
+    statsPeriod((now - periodBegin)/ticksPerNs);
+  periodBegin = now;
+}
+
+// nextPeriod moves the deadlines to the next pwm period. When the
+// generator is late by more than a period, the deadlines are reset 
+// to the current time instead of trying to catch up.
+static void nextPeriod() {
+  if(stepTicks == 0) {
+    // free running
+    periodStart = clockTicks();
+    setStepTicks();
+    return;
+  }
+  uint64_t frac = (uint64_t)MAX_VALUE*stepTicks + periodFrac;
+  periodStart += frac >> 16;
+  periodFrac = frac & 0xFFFF;
+  uint64_t now = clockTicks();
+  if((int64_t)(now - periodStart) > (int64_t)(frac >> 16)) {
+    if(computeCore >= 0)
+      atomic_fetch_add_explicit(&splitSkipNs, (now - periodStart)/ticksPerNs, memory_order_relaxed);
+    periodStart = now;
+    periodFrac = 0;
+    statsSkip();
+  }
+  // follow the tick rate and carrier frequency changes
+  clockCorrect();
+  setStepTicks();
+}
+
+// emitSteps generates the pwm period by writing the gpio registers
+// at each of the steps. The written value is updated at the edges of
+// the schedule so that the cost of a step doesn't depend on the number
+// of channels. It is inlined in the emitLoop functions with a constant 
+// number of steps.
+static inline __attribute__((always_inline)) void emitSteps(const schedule_t *sched, const uint32_t steps) {
+  uint32_t flag = sched->set;
+  int e = 0;
+  for(uint32_t i = 0; i < steps; i++) {
+    if(e < sched->nEdges && sched->edge[e].step == i)
+      flag &= ~sched->edge[e++].clr;
+    //print("step=%d flag=%08X\n", i, flag);
+    if(i == 0)
+      startPeriod();
+    else
+      waitStep(i);
+    gpioWriteSet(flag);
+    gpioWriteClr(flag^masterMask);
+  }
+}
+
+// EMIT_LOOP_BITS defines emitLoop<bits>, the emitSteps function specialized 
+// for a resolution of bits.
+#define EMIT_LOOP_BITS(bits) \
+  static void emitLoop##bits(const schedule_t *sched) { emitSteps(sched, 1 << bits); }
+
+EMIT_LOOP_BITS(8)
+EMIT_LOOP_BITS(9)
+EMIT_LOOP_BITS(10)
+EMIT_LOOP_BITS(11)
+EMIT_LOOP_BITS(12)
+EMIT_LOOP_BITS(13)
+EMIT_LOOP_BITS(14)
+EMIT_LOOP_BITS(15)
+EMIT_LOOP_BITS(16)
+
+// emitLoops holds the emitLoop functions by resolution - MIN_RESOLUTION.
+static void (*const emitLoops[])(const schedule_t*) = {
+  emitLoop8, emitLoop9, emitLoop10, emitLoop11, emitLoop12, 
+  emitLoop13, emitLoop14, emitLoop15, emitLoop16
+};
+
+_Static_assert(sizeof(emitLoops)/sizeof(emitLoops[0]) == MAX_RESOLUTION-MIN_RESOLUTION+1, "missing emitLoop functions");
+
+// buildSchedule converts the pwm values into the edge schedule of
+// the period. The channels with a pwm value bigger than 0 are set
+// at step 0, and the others are cleared. The set channels are then
+// cleared in increasing pwm value order, with one edge per distinct
+// pwm value. Channels whose pwm value is MAX_VALUE are never cleared.
+// The pwm values of the channels with their own carrier are stored
+// in duty instead.
+void buildSchedule(schedule_t *sched, const int pwmval[MAX_CHAN]) {
+  sched->set = 0;
+  sched->nEdges = 0;
+  sched->pulse = 0;
+  for(int ch = 0; ch < nChan; ch++) {
+    int val = pwmval[ch];
+    if(carrierMask & (1 << ch)) {
+      int max = chanMaxValue(ch);
+      sched->duty[ch] = val <= 0 ? 0 : val >= max ? max : val;
+      if(val > 0 && val < max)
+        sched->pulse |= 1 << ch;
+      continue;
+    }
+    if(val <= 0)
+      continue;
+    sched->set |= gpioBits[ch];
+    if(val >= MAX_VALUE)
+      continue;
+    // insert the clear edge in the schedule sorted by step
+    int i = sched->nEdges;
+    while(i > 0 && sched->edge[i-1].step > (uint32_t)val)
+      i--;
+    if(i > 0 && sched->edge[i-1].step == (uint32_t)val) {
+      sched->edge[i-1].clr |= gpioBits[ch];
+      continue;
+    }
+    memmove(sched->edge+i+1, sched->edge+i, (sched->nEdges-i)*sizeof(sched->edge[0]));
+    sched->edge[i].step = val;
+    sched->edge[i].clr = gpioBits[ch];
+    sched->nEdges++;
+  }
+}
+
+// emitSchedule generates the pwm period by writing the gpio registers
+// only at the edges of the schedule, and waiting in between.
+static void emitSchedule(const schedule_t *sched) {
+  startPeriod();
+  gpioWriteSet(sched->set);
+  gpioWriteClr(sched->set^masterMask);
+  for(int i = 0; i < sched->nEdges; i++) {
+    waitStep(sched->edge[i].step);
+    gpioWriteClr(sched->edge[i].clr);
+  }
+}
+
+// carrierEdge adds the gpio bits of the due edge of channel ch to set or
+// clr, and moves to its next edge. At the start of a period, duty is the
+// pwm value latched for the period. A channel late by more than a period
+// restarts its period now instead of trying to catch up.
+static void carrierEdge(int ch, uint32_t duty, uint32_t *set, uint32_t *clr) {
+  carrier_t *c = carriers + ch;
+  if(c->fall) {
+    *clr |= gpioBits[ch];
+    c->fall = false;
+    c->next = c->start;
+    return;
+  }
+  uint32_t max = chanMaxValue(ch);
+  uint64_t frac = (uint64_t)max*c->stepTicks + c->frac;
+  uint64_t now = clockTicks();
+  if((int64_t)(now - c->start) > (int64_t)(frac >> 16)) {
+    c->start = now;
+    c->frac = 0;
+    frac = (uint64_t)max*c->stepTicks;
+  }
+  if(duty > 0)
+    *set |= gpioBits[ch];
+  else
+    *clr |= gpioBits[ch];
+  uint64_t start = c->start;
+  c->fall = duty > 0 && duty < max;
+  if(c->fall)
+    c->next = start + (((uint64_t)duty*c->stepTicks + c->frac) >> 16);
+  c->start = start + (frac >> 16);
+  c->frac = frac & 0xFFFF;
+  if(!c->fall)
+    c->next = c->start;
+}
+
+// emitMerged generates the pwm period of the schedule merged with the 
+// edges of the channels with their own carrier up to the end of the 
+// period. The register writes due at the same time are grouped.
+static void emitMerged(const schedule_t *sched) {
+  uint64_t end = stepDeadline(MAX_VALUE);
+  startPeriod();
+  gpioWriteSet(sched->set);
+  gpioWriteClr(sched->set^masterMask);
+  int e = 0;
+  while(1) {
+    // earliest of the next edges
+    uint64_t t = e < sched->nEdges ? stepDeadline(sched->edge[e].step) : end;
+    for(uint32_t m = carrierMask; m != 0; m &= m-1) {
+      uint64_t next = carriers[__builtin_ctz(m)].next;
+      if((int64_t)(next - t) < 0)
+        t = next;
+    }
+    if(e == sched->nEdges && (int64_t)(t - end) >= 0)
+      break;
+    waitTicks(t);
+    uint32_t set = 0, clr = 0;
+    uint64_t now = clockTicks();
+    while(e < sched->nEdges && (int64_t)(stepDeadline(sched->edge[e].step) - now) <= 0)
+      clr |= sched->edge[e++].clr;
+    for(uint32_t m = carrierMask; m != 0; m &= m-1) {
+      int ch = __builtin_ctz(m);
+      if((int64_t)(carriers[ch].next - now) <= 0)
+        carrierEdge(ch, sched->duty[ch], &set, &clr);
+    }
+    if(set != 0)
+      gpioWriteSet(set);
+    if(clr != 0)
+      gpioWriteClr(clr);
+  }
+}
+
+// carrierLevels writes the static level of the channels with their own
+// carrier before the generator parks.
+static void carrierLevels(const schedule_t *sched) {
+  uint32_t set = 0, clr = 0;
+  for(uint32_t m = carrierMask; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    if(sched->duty[ch] > 0)
+      set |= gpioBits[ch];
+    else
+      clr |= gpioBits[ch];
+  }
+  gpioWriteSet(set);
+  gpioWriteClr(clr);
+}
+
+// elapsedNs returns the number of ns elapsed between the start deadlines
+// of the previous and current pwm periods. The fractions of ns are carried
+// over so that the waveforms never drift.
+static uint64_t elapsedNs() {
+  double ns = (periodStart - wavePeriod)/ticksPerNs + waveCarry;
+  wavePeriod = periodStart;
+  uint64_t n = ns;
+  waveCarry = ns - n;
+  return n;
+}
+
+// resetParams resets the parameter sets. It must be called
+// before starting the generator.
+void resetParams() {
+  bzero(paramSets, sizeof(paramSets));
+  paramsFront = 0;
+  paramsBack = 1;
+  paramsApplied = paramsSeq;
+  atomic_store(&paramsShared, 2);
+  atomic_store(&timedFree, TIMED_ALL);
+  atomic_store(&timedNew, 0);
+  atomic_store(&syncTime, 0);
+  atomic_store(&syncStarted, 0);
+  periodSync = 0;
+  syncClaimed = 0;
+  nTimed = 0;
+  nApplied = 0;
+}
+
+// fillParams stores the new parameters in the back set. When the shared 
+// set was not yet consumed by the generator, its parameters of the channels 
+// not in flags are added to the back set which replaces it.
+static void fillParams(const genParams_t params[MAX_CHAN], uint32_t flags, unsigned shared) {
+  paramSet_t *back = paramSets + paramsBack;
+  for(int ch = 0; ch < nChan; ch++)
+    if(flags & (1 << ch))
+      back->params[ch] = params[ch];
+  back->flags = flags;
+  back->seq = paramsSeq;
+  if((shared & PARAMS_NEW) == 0)
+    return;
+  paramSet_t *prev = paramSets + (shared & 3);
+  for(int ch = 0; ch < nChan; ch++)
+    if((prev->flags & ~flags) & (1 << ch))
+      back->params[ch] = prev->params[ch];
+  back->flags |= prev->flags;
+}
+
+// publishParams passes the new parameters of the channels whose bit is
+// set in flags to the generator. They are all applied in the same pwm
+// period. It must be called by one thread at a time.
+void publishParams(const genParams_t params[MAX_CHAN], uint32_t flags) {
+  unsigned shared = atomic_load_explicit(&paramsShared, memory_order_acquire);
+  paramsSeq++;
+  do {
+    // refill when the generator consumed the shared set in the mean time
+    fillParams(params, flags, shared);
+  } while(!atomic_compare_exchange_weak_explicit(&paramsShared, &shared, 
+            paramsBack | PARAMS_NEW, memory_order_acq_rel, memory_order_acquire));
+  paramsBack = shared & 3;
+  generatorWake();
+}
+
+// timedSlot returns a free slot for a timed parameter set, or -1 if the
+// queue is full. The slot stays free until it is used by publishTimedParams
+// since it must be called by the thread calling publishTimedParams.
+int timedSlot() {
+  uint64_t free = atomic_load_explicit(&timedFree, memory_order_acquire);
+  return free == 0 ? -1 : __builtin_ctzll(free);
+}
+
+// publishTimedParams queues in slot the new parameters of the channels 
+// whose bit is set in flags. The generator applies them at the first pwm
+// period starting at or after time, in CLOCK_REALTIME ns. Their variations
+// are then advanced by the time elapsed since time, as if they started at 
+// time. Sets with the same time are applied in publication order. It must
+// be called by one thread at a time.
+void publishTimedParams(int slot, uint64_t time, const genParams_t params[MAX_CHAN], uint32_t flags) {
+  atomic_fetch_and_explicit(&timedFree, ~((uint64_t)1 << slot), memory_order_relaxed);
+  timedSet_t *t = timedSets + slot;
+  t->time = time;
+  t->seq = timedSeq++;
+  for(int ch = 0; ch < nChan; ch++)
+    if(flags & (1 << ch))
+      t->set.params[ch] = params[ch];
+  t->set.flags = flags;
+  atomic_fetch_or_explicit(&timedNew, (uint64_t)1 << slot, memory_order_release);
+  generatorWake();
+}
+
+// timedQueued returns the mask of the slots of the queued timed parameter
+// sets. The bit of a slot is cleared once its set was applied and the 
+// timedHook returned true.
+uint64_t timedQueued() {
+  return ~atomic_load_explicit(&timedFree, memory_order_acquire) & TIMED_ALL;
+}
+
+// armSync arms a synchronized start at time, in CLOCK_REALTIME ns. The
+// generator delays the pwm period containing time so that it starts at
+// time, and measures the start error. Returns -1 if a synchronized start
+// is already armed.
+int armSync(uint64_t time) {
+  uint64_t none = 0;
+  if(!atomic_compare_exchange_strong(&syncTime, &none, time))
+    return -1;
+  generatorWake();
+  return 0;
+}
+
+// syncStatus returns the state of the last synchronized start, and stores
+// its time and start error in ns in time and error.
+int syncStatus(uint64_t *time, int64_t *error) {
+  *time = atomic_load(&syncTime);
+  *error = 0;
+  if(*time != 0)
+    return SYNC_ARMED;
+  *time = atomic_load(&syncStarted);
+  *error = atomic_load(&syncError);
+  return *time != 0 ? SYNC_STARTED : SYNC_NONE;
+}
+
+// paramsPending returns true when the last published parameter set has
+// not yet been consumed by the generator.
+bool paramsPending() {
+  return (atomic_load_explicit(&paramsShared, memory_order_acquire) & PARAMS_NEW) != 0;
+}
+
+// waitParams waits until the generator has consumed the last published
+// parameter set, or is stopped. In split mode, the parameters are 
+// consumed by the compute thread, up to SPLIT_SIZE periods before they
+// are emitted.
+void waitParams() {
+  while(atomic_load(&generatorRunning) && paramsPending())
+    usleep(100);
+}
+
+// generatorWake wakes up the parked generator threads. It must be called
+// after new parameters or stream frames are made available.
+void generatorWake() {
+  atomic_fetch_add(&parkSeq, 1);
+  if(atomic_load(&parkCount) > 0)
+    syscall(SYS_futex, &parkSeq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// park blocks the calling generator thread until it is woken up, or 
+// ns nanoseconds elapsed. It doesn't block when ready returns true. 
+static void park(bool (*ready)(), uint64_t ns) {
+  atomic_fetch_add(&parkCount, 1);
+  unsigned seq = atomic_load(&parkSeq);
+  if(!ready()) {
+    struct timespec t = {ns/1000000000, ns%1000000000};
+    syscall(SYS_futex, &parkSeq, FUTEX_WAIT_PRIVATE, seq, &t, NULL, 0);
+  }
+  atomic_fetch_sub(&parkCount, 1);
+}
+
+// periodTime returns the CLOCK_REALTIME time in nanoseconds of the start
+// of the current pwm period.
+static uint64_t periodTime() {
+  if(periodSync != 0)
+    return periodSync;
+  return realtimeNs() - (int64_t)((int64_t)(clockTicks() - periodStart)/ticksPerNs);
+}
+
+// splitTime returns the CLOCK_REALTIME time in nanoseconds of the start
+// of the pwm period computed by the compute thread.
+static uint64_t splitTime() {
+  return computeTime;
+}
+
+// timedDelay returns the number of ns until SLEEP_MARGIN before the first
+// queued timed parameter set must be applied, at most PARK_TIMEOUT. The
+// margin allows to start a synchronized pwm period on time.
+static uint64_t timedDelay() {
+  if(nTimed == 0)
+    return PARK_TIMEOUT;
+  int64_t ns = timedSets[timedOrder[0]].time - realtimeNs() - SLEEP_MARGIN;
+  return ns < 0 ? 0 : ns < PARK_TIMEOUT ? ns : PARK_TIMEOUT;
+}
+
+// inputPending returns true when new parameters, stream frames or timed
+// parameter sets to apply are available.
+static bool inputPending() {
+  return paramsPending() || streamPending() || atomic_load(&timedNew) != 0 || 
+    (nTimed != 0 && timedDelay() == 0);
+}
+
+// splitPending returns true when the ring holds computed pwm periods.
+static bool splitPending() {
+  return atomic_load(&splitHead) != atomic_load(&splitTail);
+}
+
+// generatorFrequency returns the mean pwm period frequency measured by
+// the generator and its standard deviation. While the generator is parked
+// without a measure, it returns the carrier frequency.
+void generatorFrequency(double *mean, double *stdDev) {
+  statsFrequency(mean, stdDev);
+  if(*mean == 0 && atomic_load(&parkCount) > 0)
+    *mean = carrierFrequency;
+}
+
+// getParams applies the new parameters if any. Returns the flags of
+// the new parameter set, or 0 if there was none.
+static uint32_t getParams() {
+  if((atomic_load_explicit(&paramsShared, memory_order_acquire) & PARAMS_NEW) == 0)
     return 0;
+  paramsFront = atomic_exchange_explicit(&paramsShared, paramsFront, memory_order_acq_rel) & 3;
+  paramSet_t *front = paramSets + paramsFront;
+  paramsApplied = front->seq;
+  for(int ch = 0; ch < nChan; ch++)
+    if(front->flags & (1 << ch))
+      waveSet(&wave, ch, front->params+ch);
+  return front->flags;
+}
+
+// freeTimed frees the slots of the applied timed parameter sets in the
+// order they were applied, until the timedHook refuses one.
+static void freeTimed() {
+  int i = 0;
+  while(i < nApplied && (timedHook == NULL || timedHook(timedApplied[i], timedSets[timedApplied[i]].after)))
+    atomic_fetch_or_explicit(&timedFree, (uint64_t)1 << timedApplied[i++], memory_order_release);
+  nApplied -= i;
+  memmove(timedApplied, timedApplied+i, nApplied*sizeof(timedApplied[0]));
+}
+
+// getTimedParams queues the new timed parameter sets, and applies those 
+// whose time is before start, the CLOCK_REALTIME time in ns of the pwm
+// period. The variations are advanced by the delay since their time.
+static void getTimedParams(uint64_t start) {
+  uint64_t m = atomic_exchange_explicit(&timedNew, 0, memory_order_acquire);
+  for(; m != 0; m &= m-1) {
+    int slot = __builtin_ctzll(m), i = nTimed++;
+    timedSet_t *t = timedSets + slot;
+    while(i > 0 && (timedSets[timedOrder[i-1]].time > t->time || 
+        (timedSets[timedOrder[i-1]].time == t->time && timedSets[timedOrder[i-1]].seq > t->seq))) {
+      timedOrder[i] = timedOrder[i-1];
+      i--;
+    }
+    timedOrder[i] = slot;
+  }
+  int n = 0;
+  while(n < nTimed && timedSets[timedOrder[n]].time <= start) {
+    timedSet_t *t = timedSets + timedOrder[n];
+    for(int ch = 0; ch < nChan; ch++)
+      if(t->set.flags & (1 << ch))
+        waveSet(&wave, ch, t->set.params+ch);
+    waveAdvanceMask(&wave, t->set.flags, start - t->time);
+    t->after = paramsApplied;
+    timedApplied[nApplied++] = timedOrder[n++];
   }
-  return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+  nTimed -= n;
+  memmove(timedOrder, timedOrder+n, nTimed*sizeof(timedOrder[0]));
+  freeTimed();
+}
+
+// computePeriod applies the new parameters if any, and computes the
+// schedule of the pwm period at the current phase of the waveforms.
+// start returns the CLOCK_REALTIME time in ns of the period. idle is set
+// to true when the pwm values are static. Returns false when the 
+// generator must stop.
+static bool computePeriod(schedule_t *sched, bool *idle, uint64_t (*start)()) {
+  if(getParams() & PARAMS_STOP)
+    return false;
+  if(nTimed != 0 || nApplied != 0 || atomic_load_explicit(&timedNew, memory_order_relaxed) != 0)
+    getTimedParams(start());
+  int pwmval[WAVE_SIZE];
+  waveStep(&wave, nChan, pwmval);
+  streamStep(pwmval);
+  buildSchedule(sched, pwmval);
+  *idle = waveStatic(&wave, nChan) && streamIdle() && nApplied == 0;
+  return true;
+}
+
+// compute is the compute thread of the split mode. It computes the pwm 
+// periods ahead of the generator until it is requested to stop, and 
+// sleeps when the ring is full. It parks after computing a period whose
+// outputs are static 0 or 1.
+static void* compute(void *unused) {
+  uint64_t last = clockNanos();
+  double carry = 0;
+  computeTime = realtimeNs();
+  while(1) {
+    // a slot is freed once per period
+    unsigned head = atomic_load_explicit(&splitHead, memory_order_relaxed);
+    while(head - atomic_load_explicit(&splitTail, memory_order_acquire) == SPLIT_SIZE)
+      usleep(carrierFrequency <= 0 || carrierFrequency > 1e4 ? 20 : 1e6/carrierFrequency/2);
+    splitEntry_t *e = splitRing + (head & (SPLIT_SIZE-1));
+    // a synchronized start delays the period to its time
+    double freq = carrierFrequency;
+    e->sync = syncDue(computeTime, freq > 0 ? 1e9/freq : 0);
+    if(e->sync > computeTime) {
+      waveAdvance(&wave, nChan, e->sync - computeTime);
+      computeTime = e->sync;
+    }
+    e->stop = !computePeriod(&e->sched, &e->idle, splitTime);
+    atomic_store_explicit(&splitHead, head+1, memory_order_release);
+    generatorWake();
+    if(e->stop)
+      return NULL;
+    if(e->idle && e->sched.nEdges == 0 && e->sched.pulse == 0) {
+      while(!inputPending())
+        park(inputPending, timedDelay());
+      last = clockNanos();
+      computeTime = realtimeNs();
+    }
+
+    // advance the waveforms to the start of the next period. When free 
+    // running, the period duration is the time elapsed since the last one.
+    double ns = carry;
+    freq = carrierFrequency;
+    ns += atomic_exchange_explicit(&splitSkipNs, 0, memory_order_relaxed);
+    uint64_t now = clockNanos();
+    ns += freq > 0 ? 1e9/freq : now - last;
+    last = now;
+    uint64_t n = ns;
+    carry = ns - n;
+    waveAdvance(&wave, nChan, n);
+    computeTime += n;
+  }
+}
+
+// startCompute starts the compute thread of the split mode, and waits 
+// until it computed the first pwm period. Returns false if it failed.
+static bool startCompute() {
+  atomic_store(&splitHead, 0);
+  atomic_store(&splitTail, 0);
+  atomic_store(&splitSkipNs, 0);
+  if(startPinnedThread(computeCore, &compute) < 0) {
+    printWarn("generator warning: failed starting the compute thread on core %d\n", computeCore);
+    return false;
+  }
+  while(atomic_load_explicit(&splitHead, memory_order_acquire) == 0)
+    usleep(20);
+  return true;
 }
 
 void* generator(void *unused) {
   // printThreadSched("generator info: started");
 
   // reset global state
-  bzero(genParams, sizeof(genParams));
-  for(int ch = 0; ch < NCHAN; ch++) // because bzero doesn't work on volatile
-    newParams[ch] = genParams[ch];
-  frequencyMean = 0;
-  frequencyVariance = 0;
+  waveReset(&wave);
+  statsReset();
+  bool split = computeCore >= 0 && startCompute();
+  void (*emitLoop)(const schedule_t*) = emitLoops[bitsResolution - MIN_RESOLUTION];
+  masterMask = chanMask;
+  for(uint32_t m = carrierMask; m != 0; m &= m-1)
+    masterMask &= ~gpioBits[__builtin_ctz(m)];
 
   // loop forever
-  uint64_t begin_time = getTimeStamp();
+  setStepTicks();
+  periodStart = clockTicks();
+  periodFrac = 0;
+  periodBegin = 0;
+  wavePeriod = periodStart;
+  waveCarry = 0;
+  resetCarriers(periodStart);
   while(1) {
-    // get new params if any
-    while(atomic_flag_test_and_set(&newParamsLock));
-    uint16_t flags = newParamFlags;
-    if (flags != 0) {
-      if ((flags & ((1<<NCHAN)-1)) != 0)
-        for(int i = 0; i < NCHAN; i++) {
-          // print("y0[%d] = %.3f\n", i, newParams[i].y0);
-          if (flags & 1)
-            genParams[i] = newParams[i];
-          flags >>= 1;
-        }
-      else 
-        flags >>= NCHAN;
-      if (flags & 1) {
-        // request to stop the generator
-        atomic_flag_clear(&newParamsLock);
-        break;
-      }
-      newParamFlags = 0;
-    }
-    atomic_flag_clear(&newParamsLock);
-
-    // for each pwm values
-    int pwmval[NCHAN];
-    // compute the channel values
-    for(int ch = 0; ch < NCHAN; ch++) {
-      double y = genParams[ch].y, dy = genParams[ch].dy;
-      double val = genParams[ch].y0 + y;
-      if (dy == 0) {
-        // constant or sinusoidal values
-        double x = genParams[ch].x, c = genParams[ch].c, s = genParams[ch].s;
-        genParams[ch].y = y*c + x*s; // c and s are premultiplied by a
-        genParams[ch].x = x*c - y*s;
-      } else {
-        // triangular values
-        y += dy;
-        double a = genParams[ch].a; 
-        if (y > a) {
-          y = 2*a - y;
-          genParams[ch].dy = -dy;
-        } else if (y < -a) {
-          y = -2*a - y; 
-          genParams[ch].dy = -dy;
-        }
-        genParams[ch].y = y;
-      }
-      //print("ch=%d val=%.3f int=%d\n", ch, val, -1-(int)(val*MAX_VALUE+.5));
-      pwmval[ch] = -1-(int)(val*MAX_VALUE+.5);
-    }
-    // generate the pwm value
-    for(int i = 0; i < MAX_VALUE; i++) {
-      uint32_t flag = 0;
-      for(int ch = 0; ch < NCHAN; ch++) {
-        pwmval[ch]++;
-        flag |= gpioBits[ch] & (pwmval[ch]>>(sizeof(int)*8-1));
-      }
-      //print("chunkIter=%d flag=%08X\n", chunkIter, flag);
-      for(int k = 0; k < PAUSE_VALUE; k++)
-        dummy++;
-      *gpioSet = flag;
-      *gpioClr = flag^CHAN_MASK;
+    schedule_t sched, *s = &sched;
+    bool idle;
+    unsigned tail = atomic_load_explicit(&splitTail, memory_order_relaxed);
+    if(split) {
+      // take the next computed period
+      while(atomic_load_explicit(&splitHead, memory_order_acquire) == tail);
+      splitEntry_t *e = splitRing + (tail & (SPLIT_SIZE-1));
+      if(e->stop)
+        break; // request to stop the generator
+      s = &e->sched;
+      idle = e->idle;
+      if(e->sync != 0)
+        syncPeriod(e->sync);
+    } else {
+      uint64_t sync = syncDue(periodTime(), MAX_VALUE*(stepTicks/65536.)/ticksPerNs);
+      if(sync != 0)
+        syncPeriod(sync);
+      // advance the waveforms to the start of the period
+      waveAdvance(&wave, nChan, elapsedNs());
+      if(!computePeriod(s, &idle, periodTime))
+        break; // request to stop the generator
     }
-  
-    // update the mean frequency and its variance
-    // see: https://forge.in2p3.fr/dmsf/files/17104/view
-    uint64_t end_time = getTimeStamp();
-    double timeDiff = (double)(end_time - begin_time) *1e-9, frequency;
-    // print("debug: timeDiff: %fs\n", timeDiff);
-    begin_time = end_time;
-    if(timeDiff != 0)
-      frequency = 1/timeDiff;
+
+    // generate the pwm period
+    periodSleep = idle;
+    if(carrierMask != 0)
+      emitMerged(s);
+    else if(emitMode == EMIT_LOOP)
+      emitLoop(s);
     else
-      frequency = 0;
-    if(frequencyMean == 0) {
-      frequencyMean = frequency;
-      frequencyVariance = 0;
-    } else {
-      double mean = frequencyMean;
-      double delta = frequency - mean;
-      double incr = alpha * delta;
-      mean += incr;
-      frequencyVariance = (1 - alpha)*(frequencyVariance + delta*incr);
-      frequencyMean = mean;
+      emitSchedule(s);
+    if(split)
+      atomic_store_explicit(&splitTail, tail+1, memory_order_release);
+    if(!idle || s->nEdges != 0 || s->pulse != 0) {
+      nextPeriod();
+      statsPublish();
+      continue;
+    }
+
+    // the outputs are static 0 or 1: park until there is something new
+    carrierLevels(s);
+    bool (*ready)() = split ? splitPending : inputPending;
+    while(!ready()) {
+      park(ready, split ? PARK_TIMEOUT : timedDelay());
+      statsPublish();
     }
-    // print("debug: frequency: mean: %.2f Hz stdDev: %.2f \n", frequencyMean, sqrt(frequencyVariance));
+    periodStart = clockTicks();
+    periodFrac = 0;
+    periodBegin = 0;
+    wavePeriod = periodStart;
+    waveCarry = 0;
+    resetCarriers(periodStart);
   }
   // print("generator info: stopped\n");
+  atomic_store(&generatorRunning, false);
   return NULL;
 }
 
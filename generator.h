@@ -4,34 +4,157 @@
 #define _GNU_SOURCE
 #include <stdint.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 
-#include "gpio.h" // for NCHAN
+#include "gpio.h" // for MAX_CHAN
 
 #define UNUSED(x) (void)(x)
 
 // program parameters
-#define BITS_RESOLUTION 12
-#define MAX_VALUE (1 << BITS_RESOLUTION)
+#define BITS_RESOLUTION 12 // default number of bits of the pwm values
+#define MIN_RESOLUTION 8   // minimum number of bits of the pwm values
+#define MAX_RESOLUTION 16  // maximum number of bits of the pwm values
+#define MAX_VALUE (1 << bitsResolution) // number of steps of a pwm period
 #define CHUNK_SIZE 32000
+#define DEFAULT_CARRIER 10 // default pwm period frequency in Hz
+#define ARB_MAX_SAMPLES 16384 // maximum number of samples of an arbitrary waveform
+#define ARB_MAX_RATE 1000000  // maximum playback rate of an arbitrary waveform in samples per second
+#define SPLIT_SIZE 8 // number of pwm periods computed ahead in split mode, must be a power of 2
+#define TIMED_SIZE 64 // maximum number of queued timed parameter sets, at most 64
+#define PARK_TIMEOUT 100000000 // maximum duration in ns of a generator park
+#define SLEEP_MARGIN 100000    // ns before a deadline at which a static generator stops sleeping
 
 
 // generator parameters for an output.
-// Constant requires: x=y=dy=c=s=a=0, y0>=0, y0<=1.
-// Sinusoidal requires: dy=0, x²+y²=1, c²+s²=1, a!=0, y0+a<=1, y0-a>=0.
-// Triangular requires: s=c=x=0, a!=0, y>=0, y<=1, dy>0, dy<.5, y0+a<=1, y0-a>=0. 
+// Constant requires: a=freq=phase=tri=0, y0>=0, y0<=1.
+// Sinusoidal requires: tri=0, a!=0, freq!=0, y0+a<=1, y0-a>=0.
+// Triangular requires: tri=1, a!=0, freq!=0, y0+a<=1, y0-a>=0. 
+// Arbitrary requires: y0=a=freq=phase=tri=0, tbl!=NULL, len>0, pos<len<<ARB_FRAC_BITS.
 typedef struct {
-  double y0;     // offset of y0, 
-  double x, y;   // X,Y value (pwmValue = (uint)((y0+y*a+.5)*PWM_VALUES_LIMIT)
-  double c, s;   // cosine and sinus of the step angle 
+  double y0;     // average value
   double a;      // amplitude of variation (constant when a = 0)
-  double dy;     // step size for triangular variation
+  uint64_t phase;// phase at start (2^64 = period)
+  uint64_t freq; // phase increment per ns
+  int tri;       // 1 for a triangular variation, 0 for a sinusoidal one
+  const uint16_t *tbl; // samples of arbitrary variation (65535 = 1), NULL otherwise
+  uint32_t len;  // number of samples in tbl
+  uint32_t loop; // 1 to play the samples in loop, 0 to hold the last one
+  uint64_t pos;  // playback position in tbl in 1/2^ARB_FRAC_BITS samples
+  uint64_t step; // playback step per ns in 1/2^ARB_FRAC_BITS samples
 } genParams_t;
 
-extern volatile genParams_t newParams[NCHAN]; // new parameters set by main thread
-extern volatile uint32_t newParamFlags;       // bit set by main thread for each new params
-extern atomic_flag newParamsLock;             // lock protecting newParams access
-extern volatile double frequencyMean;         // mean frequency with exponentialy decaying weighting
-extern volatile double frequencyVariance;     // frequency variance with exponentialy decaying weighting
+// pwm period emission modes
+#define EMIT_LOOP 0 // write the gpio registers at each of the MAX_VALUE steps
+#define EMIT_EDGE 1 // write the gpio registers only at the edges of the schedule
+
+// schedule_t is the edge schedule of a pwm period. The gpio bits in set
+// are set at step 0, and the other channels are cleared. The gpio bits
+// in edge[i].clr are cleared at step edge[i].step. Edges are sorted by
+// increasing step and there is at most one edge per step. The channels
+// with their own carrier are not in the edges, their pwm value is in duty.
+typedef struct {
+  uint32_t set;     // gpio bits set at step 0
+  int nEdges;       // number of clear edges
+  struct {
+    uint32_t step;  // step at which the gpio bits are cleared
+    uint32_t clr;   // gpio bits to clear
+  } edge[MAX_CHAN];
+  uint32_t pulse;   // channels with their own carrier and a fractional pwm value
+  uint32_t duty[MAX_CHAN]; // pwm value of the channels with their own carrier
+} schedule_t;
+
+#define PARAMS_STOP (1u << 31) // flag requesting the generator to stop
+
+extern atomic_bool generatorRunning;          // true until the generator stopped
+extern int emitMode;                          // pwm period emission mode (EMIT_LOOP or EMIT_EDGE)
+extern int bitsResolution;                    // number of bits of the pwm values, set before starting the generator
+extern volatile double carrierFrequency;      // target pwm period frequency in Hz, 0 to free run
+extern int computeCore;                       // core of the compute thread in split mode, -1 to compute in the generator
+extern bool (*timedHook)(int slot, uint32_t after); // called when a timed parameter set is applied, may be NULL
+extern uint32_t paramsSeq;                    // number of sets published with publishParams
+extern double chanCarrier[MAX_CHAN];          // carrier frequency of each channel in Hz, 0 for the common carrier
+extern int chanBits[MAX_CHAN];                // resolution of each channel in bits, 0 for the common resolution
+extern uint32_t carrierMask;                  // channels with their own carrier
+
+// chanMaxValue returns the number of steps of a pwm period of channel ch.
+static inline int chanMaxValue(int ch) {
+  return chanBits[ch] != 0 ? 1 << chanBits[ch] : MAX_VALUE;
+}
+
+// carrierConfig sets the carrier frequency and resolution of the channels
+// from a comma separated list of ch=hz or ch=hz/bits. The other channels
+// follow the common carrier. It must be called before starting the 
+// generator. Returns -1 if the list is invalid.
+int carrierConfig(const char *list);
+
+// buildSchedule converts the pwm values, number of steps each channel
+// stays high, into the edge schedule of a pwm period.
+void buildSchedule(schedule_t *sched, const int pwmval[MAX_CHAN]);
+
+// resetParams resets the parameter sets. It must be called
+// before starting the generator.
+void resetParams();
+
+// publishParams passes the new parameters of the channels whose bit is
+// set in flags to the generator. They are all applied in the same pwm
+// period. The parameters of a set not yet consumed by the generator are
+// merged into the new set. PARAMS_STOP in flags requests the generator 
+// to stop. The generator is never blocked by this call. It must be called 
+// by one thread at a time.
+void publishParams(const genParams_t params[MAX_CHAN], uint32_t flags);
+
+// timedSlot returns a free slot for a timed parameter set, or -1 if the
+// queue is full. The slot stays free until it is used by publishTimedParams
+// since it must be called by the thread calling publishTimedParams.
+int timedSlot();
+
+// publishTimedParams queues in slot the new parameters of the channels 
+// whose bit is set in flags. The generator applies them at the first pwm
+// period starting at or after time, in CLOCK_REALTIME ns. Their variations
+// are then advanced by the time elapsed since time, as if they started at 
+// time. Sets with the same time are applied in publication order. It must
+// be called by one thread at a time.
+void publishTimedParams(int slot, uint64_t time, const genParams_t params[MAX_CHAN], uint32_t flags);
+
+// timedQueued returns the mask of the slots of the queued timed parameter
+// sets. The bit of a slot is cleared once its set was applied and the 
+// timedHook returned true. The hook also receives the publication number
+// of the last set of publishParams applied before the timed set, so that 
+// the sets published after it are known to override it.
+uint64_t timedQueued();
+
+// armSync arms a synchronized start at time, in CLOCK_REALTIME ns. The
+// generator delays the pwm period containing time so that it starts at
+// time, and measures the start error. Returns -1 if a synchronized start
+// is already armed.
+int armSync(uint64_t time);
+
+#define SYNC_NONE    0 // no synchronized start was armed
+#define SYNC_ARMED   1 // the synchronized start is armed
+#define SYNC_STARTED 2 // the synchronized start happened
+
+// syncStatus returns the state of the last synchronized start, and stores
+// its time and start error in ns in time and error.
+int syncStatus(uint64_t *time, int64_t *error);
+
+// paramsPending returns true when the last published parameter set has
+// not yet been consumed by the generator.
+bool paramsPending();
+
+// generatorWake wakes up the parked generator threads. It must be called
+// after new parameters or stream frames are made available.
+void generatorWake();
+
+// generatorFrequency returns the mean pwm period frequency measured by
+// the generator and its standard deviation. While the generator is parked
+// without a measure, it returns the carrier frequency.
+void generatorFrequency(double *mean, double *stdDev);
+
+// waitParams waits until the generator has consumed the last published
+// parameter set, or is stopped. In split mode, the parameters are 
+// consumed by the compute thread, up to SPLIT_SIZE periods before they
+// are emitted.
+void waitParams();
 
 void* generator(void *);
 
@@ -13,6 +13,7 @@ const (
 	CST Type = iota
 	SIN
 	TRI
+	ARB
 )
 
 var (
@@ -34,6 +35,8 @@ func (t Type) String() string {
 		return "SIN"
 	case TRI:
 		return "TRI"
+	case ARB:
+		return "ARB"
 	}
 	return "?"
 }
@@ -277,6 +280,8 @@ func (p *PWMGenerator) Params() ([]Param, error) {
 			prm[ch].Type = SIN
 		case "TRI":
 			prm[ch].Type = TRI
+		case "ARB":
+			prm[ch].Type = ARB
 		default:
 			return nil, NotFatalError{err: ErrInvalidResponse}
 		}
@@ -18,6 +18,7 @@
 // for setting or clearing gpio outputs.
 volatile uint32_t *gpioSet;
 volatile uint32_t *gpioClr;
+bool gpioRecorded;
 
 // #define BCM2708_PERI_BASE        0x20000000  /* Raspberry PI? */
 // #define BCM2711_PERI_BASE        0xFE000000  /* Raspberry PI4 */
@@ -28,8 +29,10 @@ int piCores;
 int pi_ispi;
 uint32_t pi_peri_phys;
 
-uint32_t gpioBits[NCHAN] = {CHAN0BIT, CHAN1BIT, CHAN2BIT, CHAN3BIT, CHAN4BIT, CHAN5BIT, CHAN6BIT, CHAN7BIT};
-uint32_t gpioID[NCHAN] = {CHAN0, CHAN1, CHAN2, CHAN3, CHAN4, CHAN5, CHAN6, CHAN7};
+int nChan;
+uint32_t gpioBits[MAX_CHAN];
+uint32_t gpioID[MAX_CHAN];
+uint32_t chanMask;
 
 
 // GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
@@ -143,6 +146,49 @@ unsigned gpioHardwareRevision(void) {
    return rev;
 }
 
+// gpio_config sets the channels to GPIO mapping from a comma separated 
+// list of GPIO ids (e.g. "9,10,11"). The number of channels is the 
+// number of GPIO ids in the list. The GPIO ids must be in the range
+// [MIN_GPIO,MAX_GPIO] and all different. It must be called before
+// gpio_init. Returns 0 when it succeeds and -1 otherwise. 
+int gpio_config(const char *pins) {
+   uint32_t ids[MAX_CHAN], mask = 0;
+   int n = 0;
+   const char *p = pins;
+   while(1) {
+      char *end;
+      long id = strtol(p, &end, 10);
+      if(end == p || id < MIN_GPIO || id > MAX_GPIO) {
+         printErr("gpio_config: invalid GPIO id in \"%s\"\n", pins);
+         return -1;
+      }
+      if(mask & (1 << id)) {
+         printErr("gpio_config: duplicate GPIO id %ld in \"%s\"\n", id, pins);
+         return -1;
+      }
+      if(n == MAX_CHAN) {
+         printErr("gpio_config: more than %d GPIO ids in \"%s\"\n", MAX_CHAN, pins);
+         return -1;
+      }
+      mask |= 1 << id;
+      ids[n++] = id;
+      if(*end == '\0')
+         break;
+      if(*end != ',') {
+         printErr("gpio_config: expected ',' in \"%s\"\n", pins);
+         return -1;
+      }
+      p = end+1;
+   }
+   for(int i = 0; i < n; i++) {
+      gpioID[i] = ids[i];
+      gpioBits[i] = 1 << ids[i];
+   }
+   nChan = n;
+   chanMask = mask;
+   return 0;
+}
+
 // Set up a memory regions to access GPIO
 int gpio_init() {
 	int  mem_fd;
@@ -154,6 +200,9 @@ int gpio_init() {
    if(gpioSet != NULL || gpioClr != NULL)
 		return -1;
 
+   if(nChan == 0 && gpio_config(DEFAULT_PINS) < 0)
+      return -1;
+
    unsigned rev = gpioHardwareRevision();
    if(rev == 0) {
       // if host is not a raspberry pi, it's ok.
@@ -186,9 +235,9 @@ int gpio_init() {
       return -1;
    }
 
-   // set all channels to output mode
+   // set the configured channels to output mode
    uint32_t *gpio = (uint32_t *)gpio_map;
-   for(int i = 0; i < NCHAN; i++) {
+   for(int i = 0; i < nChan; i++) {
       uint32_t reg = gpioID[i]/10;
       uint32_t shift = (gpioID[i]%10) * 3;
       gpio[reg] &= ~(7<<shift);
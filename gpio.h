@@ -2,30 +2,18 @@
 #define GPIO_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-#define NCHAN  8
+#define MAX_CHAN 26 // maximum number of channels (GPIO 2 to 27)
+#define MIN_GPIO  2 // smallest usable GPIO id
+#define MAX_GPIO 27 // biggest usable GPIO id
 
-#define CHAN0  9 /* GPIO  9 */ 
-#define CHAN1 10 /* GPIO 10 */
-#define CHAN2 11 /* GPIO 11 */
-#define CHAN3 12 /* GPIO 12 */
-#define CHAN4 13 /* GPIO 13 */
-#define CHAN5 14 /* GPIO 14 */
-#define CHAN6 15 /* GPIO 15 */
-#define CHAN7 16 /* GPIO 16 */
+#define DEFAULT_PINS "9,10,11,12,13,14,15,16" // default channel to GPIO mapping
 
-#define CHAN0BIT (1<<CHAN0) 
-#define CHAN1BIT (1<<CHAN1)
-#define CHAN2BIT (1<<CHAN2)
-#define CHAN3BIT (1<<CHAN3)
-#define CHAN4BIT (1<<CHAN4)
-#define CHAN5BIT (1<<CHAN5)
-#define CHAN6BIT (1<<CHAN6)
-#define CHAN7BIT (1<<CHAN7)
-
-#define CHAN_MASK (CHAN0BIT|CHAN1BIT|CHAN2BIT|CHAN3BIT|CHAN4BIT|CHAN5BIT|CHAN6BIT|CHAN7BIT)
-
-extern uint32_t gpioBits[NCHAN];
+extern int nChan;                  // number of channels
+extern uint32_t gpioID[MAX_CHAN];  // GPIO id of each channel
+extern uint32_t gpioBits[MAX_CHAN];// GPIO register bit of each channel
+extern uint32_t chanMask;          // GPIO register bits of all channels
 
 // gpioSet is pointer to GPIO register to set a gpio output. 
 // The instruction *gpioSet = x; will set the gpio outputs 
@@ -43,6 +31,29 @@ extern volatile uint32_t *gpioSet;
 // returns an undefined value.
 extern volatile uint32_t *gpioClr;
 
+// gpioRecorded is true when the writes to gpioSet and gpioClr are
+// recorded by the simulation backend (see sim.h).
+extern bool gpioRecorded;
+
+// simRecord records the gpio outputs set and cleared by a write.
+void simRecord(uint32_t set, uint32_t clr);
+
+// gpioWriteSet sets the gpio outputs according to the bits set in x,
+// and records the write when gpioRecorded is true.
+static inline void gpioWriteSet(uint32_t x) {
+  *gpioSet = x;
+  if(gpioRecorded)
+    simRecord(x, 0);
+}
+
+// gpioWriteClr clears the gpio outputs according to the bits set in x,
+// and records the write when gpioRecorded is true.
+static inline void gpioWriteClr(uint32_t x) {
+  *gpioClr = x;
+  if(gpioRecorded)
+    simRecord(0, x);
+}
+
 // gpio_init initializes the gpio and return NULL when it succeed.
 // It returns 0 if the host is a supported raspberry device. It
 // returns 1 if the host is not a raspberry device in which
@@ -54,5 +65,12 @@ extern volatile uint32_t *gpioClr;
 // functionnal and gpioSet and gpioClr are both null.
 int gpio_init();
 
+// gpio_config sets the channels to GPIO mapping from a comma separated 
+// list of GPIO ids (e.g. "9,10,11"). The number of channels is the 
+// number of GPIO ids in the list. The GPIO ids must be in the range
+// [MIN_GPIO,MAX_GPIO] and all different. It must be called before
+// gpio_init. Returns 0 when it succeeds and -1 otherwise. 
+int gpio_config(const char *pins);
+
 
 #endif // GPIO_H
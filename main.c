@@ -4,6 +4,10 @@
 #include "server.h"
 #include "hexdump.h"
 #include "print.h"
+#include "clock.h"
+#include "wave.h"
+#include "sim.h"
+#include "shm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,25 +15,117 @@
 #include <math.h>   // needed for sin and cos TBR
 #include <unistd.h> // needed for sleep TBR
 #include <stdint.h>
+#include <getopt.h>
 
 #define UNUSED(x) (void)(x)
 
 // compile : gcc -I. *.c -O3 -latomic -lm -lpthread -Wall && sudo ./a.out 4000
 
+void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-m edge|loop] [-f hz] [-p pins] [-r bits] [-F carriers] [-c core] [-s trace] [-l level] [-o log] [-S shm] [port]\n", name);
+  fprintf(stderr, "  -m mode  pwm emission mode: edge (default) or loop\n");
+  fprintf(stderr, "  -f hz    pwm carrier frequency in Hz (default %d)\n", DEFAULT_CARRIER);
+  fprintf(stderr, "  -p pins  comma separated GPIO ids of the channels (default %s)\n", DEFAULT_PINS);
+  fprintf(stderr, "  -r bits  resolution of the pwm values in bits, %d to %d (default %d)\n", MIN_RESOLUTION, MAX_RESOLUTION, BITS_RESOLUTION);
+  fprintf(stderr, "  -F list  comma separated ch=hz or ch=hz/bits giving channels their own carrier and resolution\n");
+  fprintf(stderr, "  -c core  compute the pwm periods ahead in a thread pinned on core (2 recommended)\n");
+  fprintf(stderr, "  -s trace record the gpio edges in the trace file (VCD, or CSV if it ends with .csv)\n");
+  fprintf(stderr, "  -l level log level: debug, info (default), warn or error\n");
+  fprintf(stderr, "  -o log   append the log messages to the log file instead of stdout and stderr\n");
+  fprintf(stderr, "  -S shm   serve same host clients in the shared memory control segment shm (e.g. /pwmgenerator)\n");
+}
+
 int main(int argc, char *argv[]) {
+  int opt;
+  const char *trace = NULL, *carriers = NULL, *shm = NULL;
+  while((opt = getopt(argc, argv, "m:f:p:r:F:c:s:l:o:S:")) != -1) {
+    switch(opt) {
+    case 'm':
+      if(strcmp(optarg, "edge") == 0)
+        emitMode = EMIT_EDGE;
+      else if(strcmp(optarg, "loop") == 0)
+        emitMode = EMIT_LOOP;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'f':
+      carrierFrequency = atof(optarg);
+      if(carrierFrequency <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'p':
+      if(gpio_config(optarg) < 0)
+        return 1;
+      break;
+    case 'r':
+      bitsResolution = atoi(optarg);
+      if(bitsResolution < MIN_RESOLUTION || bitsResolution > MAX_RESOLUTION) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'F':
+      carriers = optarg;
+      break;
+    case 'c':
+      computeCore = atoi(optarg);
+      if(computeCore < 0 || computeCore == 3) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      trace = optarg;
+      break;
+    case 'l':
+      if(logSetLevel(optarg) < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'o':
+      if(logOpen(optarg) < 0)
+        return 1;
+      break;
+    case 'S':
+      shm = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
   int port = 1234;
-  if(argc > 1) {
-    port = atoi(argv[1]);
+  if(optind < argc) {
+    port = atoi(argv[optind]);
     if(port <= 1024)
       port = 1234;
-  } else
-    port = 1234;
+  }
 
 
+  // calibrate the generator clock
+  if(clockInit() < 0)
+    exit(-1);
+
   // initialize GPIO
   int res = gpio_init();
   if(res < 0)
     exit(-1);
+  if(carriers != NULL) {
+    if(emitMode == EMIT_LOOP) {
+      fprintf(stderr, "channels with their own carrier require the edge emission mode\n");
+      return 1;
+    }
+    if(carrierConfig(carriers) < 0) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
   if(res == 1)
     print("non-rasberry host: writing to gpio has no effect\n");
   else {
@@ -51,8 +147,25 @@ int main(int argc, char *argv[]) {
     fclose(f);
   }
 
+  // record the gpio edges
+  if(trace != NULL) {
+    if(simOpen(trace) < 0)
+      exit(-1);
+    print("simulation info: recording gpio edges in %s\n", trace);
+  }
 
-
+  print("generator info: %d channels, %d bits, %s waveform kernel\n", nChan, bitsResolution, waveKernel);
+  for(uint32_t m = carrierMask; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    print("generator info: channel %d carrier %gHz, %d bits\n", ch, chanCarrier[ch], chanBits[ch] ? chanBits[ch] : bitsResolution);
+  }
+  if(computeCore >= 0)
+    print("generator info: pwm periods computed on core %d\n", computeCore);
+  if(shm != NULL) {
+    if(shmInit(shm) < 0)
+      exit(-1);
+    print("shm info: serving the control segment %s\n", shm);
+  }
   printErr("main error: %d\n", serve(port));
   return -1;
 }
@@ -0,0 +1,260 @@
+#include "observer.h"
+#include "command.h"
+#include "generator.h"
+#include "thread.h"
+#include "print.h"
+#include "stats.h"
+#include "parse.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#define OBS_MAX_EVENTS 64 // maximum number of events handled per epoll_wait
+#define OBS_REQ_SIZE  256 // maximum size of an observer request
+
+// obsConn_t is the state of an observer connection.
+typedef struct {
+  int fd;
+  int timerFd;             // timerfd of the telemetry pushes, -1 if not subscribed
+  int len;                 // number of bytes in req
+  char req[OBS_REQ_SIZE];  // received data
+  char addrStr[256];
+} obsConn_t;
+
+int obsEpoll = -1; // epoll file descriptor of the observer thread
+
+// obsClose closes the observer connection and releases it.
+static void obsClose(obsConn_t *o) {
+  print("stop observing from %s\n", o->addrStr);
+  close(o->fd);
+  armTimer(&o->timerFd, 0);
+  free(o);
+}
+
+// obsSubscribe arms the telemetry timer of o to expire every ms 
+// milliseconds, or stops it when ms is 0. The timer events are told apart
+// from the connection events by the lowest bit of their data. Returns -1
+// if it fails.
+static int obsSubscribe(obsConn_t *o, int ms) {
+  bool added = o->timerFd >= 0;
+  if(armTimer(&o->timerFd, ms) < 0)
+    return -1;
+  if(added || o->timerFd < 0)
+    return 0;
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = (uintptr_t)o | 1};
+  if(epoll_ctl(obsEpoll, EPOLL_CTL_ADD, o->timerFd, &ev) < 0) {
+    printWarn("observer warning: epoll_ctl: %s\n", strerror(errno));
+    armTimer(&o->timerFd, 0);
+    return -1;
+  }
+  return 0;
+}
+
+// obsRequest appends the response to the request of len bytes at req of
+// the observer o in rsp. Returns the response length or -1 if rsp is too
+// small.
+static int obsRequest(obsConn_t *o, char *req, int len, char *rsp, int size) {
+  if(len == 5 && memcmp(req, "GPRM\n", 5) == 0) {
+    cmdParams_t p[MAX_CHAN];
+    snapshotParams(p);
+    rsp[0] = '>';
+    int n = formatParams(rsp+1, size-2, p);
+    if(n < 0)
+      return -1;
+    rsp[n+1] = '\n';
+    return n+2;
+  }
+  if(len == 5 && memcmp(req, "STAT\n", 5) == 0) {
+    // a buffer per call since observerAdd processes requests on the server thread
+    stats_t s;
+    statsSnapshot(&s);
+    rsp[0] = '>';
+    int n = formatStats(rsp+1, size-2, &s);
+    if(n < 0)
+      return -1;
+    rsp[n+1] = '\n';
+    return n+2;
+  }
+  int n;
+  if(len == 5 && memcmp(req, "FREQ\n", 5) == 0) {
+    double mean, stdDev;
+    generatorFrequency(&mean, &stdDev);
+    n = snprintf(rsp, size, ">%g %g\n", mean, stdDev);
+  }
+  else if(len == 5 && memcmp(req, "SYNE\n", 5) == 0) {
+    uint64_t time;
+    int64_t error;
+    int state = syncStatus(&time, &error);
+    n = snprintf(rsp, size, ">%d %llu.%09llu %lld\n", state, (unsigned long long)(time/1000000000), 
+      (unsigned long long)(time%1000000000), (long long)error);
+  }
+  else if(len >= 5 && memcmp(req, "SUBS ", 5) == 0) {
+    int ms;
+    char *p = parseInt(req+5, req+len-1, &ms);
+    if(p != req+len-1 || (ms != 0 && (ms < SUBS_MIN_INTERVAL || ms > SUBS_MAX_INTERVAL)))
+      n = snprintf(rsp, size, "!expect an interval of 0 or %d to %d ms\n", SUBS_MIN_INTERVAL, SUBS_MAX_INTERVAL);
+    else if(obsSubscribe(o, ms) < 0)
+      n = snprintf(rsp, size, "!failed arming the telemetry timer\n");
+    else
+      n = snprintf(rsp, size, ">DONE\n");
+  }
+  else if(len >= 5 && (memcmp(req, "SPRM ", 5) == 0 || memcmp(req, "TPRM ", 5) == 0 || memcmp(req, "SYNC ", 5) == 0 ||
+          memcmp(req, "STBL ", 5) == 0 || memcmp(req, "STRM ", 5) == 0))
+    n = snprintf(rsp, size, "!read-only session\n");
+  else
+    n = snprintf(rsp, size, "!undefined request \"%.*s\"\n", len-1 < 64 ? len-1 : 64, req);
+  return n < size ? n : -1;
+}
+
+// obsSend sends the len bytes of rsp. The socket is non-blocking, an
+// observer not reading its responses fast enough is thus disconnected.
+// Returns -1 if the connection must be closed.
+static int obsSend(obsConn_t *o, const char *rsp, int len) {
+  if(len > 0 && write(o->fd, rsp, len) != len) {
+    printWarn("observer warning: failed sending response to %s\n", o->addrStr);
+    return -1;
+  }
+  return 0;
+}
+
+// obsProcess handles the complete requests received and sends their
+// responses with as few writes as possible. Returns -1 if the connection
+// must be closed.
+static int obsProcess(obsConn_t *o) {
+  char rsp[BUFFER_SIZE];
+  int beg = 0, len = 0;
+  for(int i = 0; i < o->len; i++) {
+    if(o->req[i] != '\n')
+      continue;
+    int n = obsRequest(o, o->req+beg, i+1-beg, rsp+len, sizeof(rsp)-len);
+    if(n < 0) {
+      // send the responses and retry
+      if(obsSend(o, rsp, len) < 0)
+        return -1;
+      len = 0;
+      i--;
+      continue;
+    }
+    len += n;
+    beg = i+1;
+  }
+  if(beg == 0 && o->len == OBS_REQ_SIZE) {
+    printWarn("observer warning: request too long from %s\n", o->addrStr);
+    return -1;
+  }
+  o->len -= beg;
+  memmove(o->req, o->req+beg, o->len);
+  return obsSend(o, rsp, len);
+}
+
+// obsRead reads the available data and handles the received requests.
+// Returns -1 if the connection must be closed.
+static int obsRead(obsConn_t *o) {
+  while(1) {
+    ssize_t n = read(o->fd, o->req+o->len, OBS_REQ_SIZE-o->len);
+    if(n == 0)
+      return -1;
+    if(n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    o->len += n;
+    if(obsProcess(o) < 0)
+      return -1;
+  }
+}
+
+// obsPush sends the telemetry line if the telemetry timer of o expired.
+// Returns -1 if the connection must be closed.
+static int obsPush(obsConn_t *o) {
+  uint64_t expirations;
+  if(read(o->timerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return 0;
+  static stats_t s; // only used by the observer thread
+  char rsp[BUFFER_SIZE];
+  rsp[0] = '*';
+  int n = formatTelemetry(rsp+1, sizeof(rsp)-2, &s);
+  if(n < 0)
+    return -1;
+  rsp[n+1] = '\n';
+  return obsSend(o, rsp, n+2);
+}
+
+// observer is the thread serving the observer connections.
+static void* observer(void* dummy) {
+  (void)dummy;
+  struct epoll_event events[OBS_MAX_EVENTS];
+  while(1) {
+    int n = epoll_wait(obsEpoll, events, OBS_MAX_EVENTS, -1);
+    if(n < 0) {
+      if(errno != EINTR)
+        printErr("observer error: epoll_wait: %s\n", strerror(errno));
+      continue;
+    }
+    for(int i = 0; i < n; i++) {
+      obsConn_t *o = (obsConn_t*)(uintptr_t)(events[i].data.u64 & ~(uint64_t)1);
+      if(o == NULL)
+        continue; // closed while handling a previous event of the batch
+      int res = (events[i].data.u64 & 1) != 0 ? obsPush(o) : obsRead(o);
+      if((events[i].events & (EPOLLERR|EPOLLHUP)) == 0 && res >= 0)
+        continue;
+      for(int j = i+1; j < n; j++)
+        if((events[j].data.u64 & ~(uint64_t)1) == (uintptr_t)o)
+          events[j].data.u64 = 0;
+      obsClose(o); // closing the fds removes them from the epoll set
+    }
+  }
+  return NULL;
+}
+
+// observerInit starts the observer thread. Returns -1 if it fails, in
+// which case observers are rejected.
+int observerInit() {
+  if((obsEpoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    printErr("observer error: epoll_create1: %s\n", strerror(errno));
+    return -1;
+  }
+  if(startThread(&observer) < 0) {
+    close(obsEpoll);
+    obsEpoll = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// observerAdd passes the connection c, whose greeting has been answered,
+// to the observer thread. The requests already received are processed
+// immediately. Returns 0 if the connection is taken over, otherwise -1
+// and the connection must be closed by the caller.
+int observerAdd(conn_t *c) {
+  int pending = c->end - c->beg;
+  if(obsEpoll < 0 || pending > OBS_REQ_SIZE)
+    return -1;
+  obsConn_t *o = malloc(sizeof(obsConn_t));
+  if(o == NULL)
+    return -1;
+  o->fd = c->fd;
+  o->timerFd = -1;
+  o->len = pending;
+  memcpy(o->req, c->req+c->beg, pending);
+  strcpy(o->addrStr, c->addrStr);
+  int flags = fcntl(o->fd, F_GETFL);
+  if(flags < 0 || fcntl(o->fd, F_SETFL, flags|O_NONBLOCK) < 0 || obsProcess(o) < 0) {
+    free(o);
+    return -1;
+  }
+  print("start observing from %s\n", o->addrStr);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = o};
+  if(epoll_ctl(obsEpoll, EPOLL_CTL_ADD, o->fd, &ev) < 0) {
+    printWarn("observer warning: epoll_ctl: %s\n", strerror(errno));
+    free(o);
+    return -1;
+  }
+  c->fd = -1;
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef OBSERVER_H
+#define OBSERVER_H
+
+#include "server.h"
+
+// Observers are read-only sessions opened with the PWMR greeting. Any
+// number of observers may be connected while a controller is active. They
+// are all served by a single thread waiting on epoll, and only read 
+// snapshots of the generator state so that they never block the command
+// handler or the generator. Observers too slow to read their responses
+// are disconnected.
+
+// observerInit starts the observer thread. Returns -1 if it fails, in
+// which case observers are rejected.
+int observerInit();
+
+// observerAdd passes the connection c, whose greeting has been answered,
+// to the observer thread. The requests already received are processed
+// immediately. Returns 0 if the connection is taken over, otherwise -1
+// and the connection must be closed by the caller.
+int observerAdd(conn_t *c);
+
+#endif // OBSERVER_H
@@ -0,0 +1,157 @@
+#include "parse.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#define MAX_DIGITS 19          // number of decimal digits that fit in a uint64_t
+#define MAX_EXACT (1ULL << 53) // biggest mantissa exactly represented by a double
+#define MAX_TOKEN 128          // maximum length of a number decoded with sscanf
+
+// exact powers of ten of Clinger's fast path
+static const double pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// isSpace returns true for the white spaces skipped by scanf.
+static inline bool isSpace(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool isDigit(char c) {
+  return (unsigned char)(c - '0') < 10;
+}
+
+// skipSpaces returns a pointer to the first non white space at p.
+static inline char* skipSpaces(char *p, char *end) {
+  while(p < end && isSpace(*p))
+    p++;
+  return p;
+}
+
+// parseInt decodes the integer at p, after optional white spaces, as the
+// scanf %d conversion. It stores it in v and returns a pointer after it,
+// or NULL if there is no integer before end.
+char* parseInt(char *p, char *end, int *v) {
+  p = skipSpaces(p, end);
+  bool neg = false;
+  if(p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+  if(p == end || !isDigit(*p))
+    return NULL;
+  // saturate as strtol, and truncate to an int as scanf
+  unsigned long n = 0, max = neg ? (unsigned long)LONG_MAX+1 : LONG_MAX;
+  for(; p < end && isDigit(*p); p++) {
+    unsigned d = *p - '0';
+    n = n > (max - d)/10 ? max : n*10 + d;
+  }
+  *v = (int)(neg ? (long)(0UL-n) : (long)n);
+  return p;
+}
+
+// parseSpecial decodes the hexadecimal, infinite or nan number at p with
+// sscanf on a copy of the token, so that it never reads beyond end.
+static char* parseSpecial(char *p, char *end, double *v) {
+  char tok[MAX_TOKEN];
+  int len = 0, n = 0;
+  while(p+len < end && len < MAX_TOKEN-1 && !isSpace(p[len]) && p[len] != '\0') {
+    tok[len] = p[len];
+    len++;
+  }
+  tok[len] = '\0';
+  if(sscanf(tok, "%lg%n", v, &n) != 1)
+    return NULL;
+  return p+n;
+}
+
+// parseDouble decodes the floating point number at p, after optional
+// white spaces, as the scanf %lg conversion. It stores it in v and
+// returns a pointer after it, or NULL if there is no number before end.
+char* parseDouble(char *p, char *end, double *v) {
+  p = skipSpaces(p, end);
+  char *start = p;
+  bool neg = false;
+  if(p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+
+  // mantissa, whose digits overflow m when there are more than MAX_DIGITS
+  uint64_t m = 0;
+  char *digits = p;
+  for(; p < end && isDigit(*p); p++)
+    m = m*10 + (*p - '0');
+  int nDigits = p - digits, exp = 0;
+  if(p < end && (*p|0x20) == 'x' && nDigits == 1 && m == 0)
+    return parseSpecial(start, end, v);
+  if(p < end && *p == '.') {
+    char *frac = ++p;
+    for(; p < end && isDigit(*p); p++)
+      m = m*10 + (*p - '0');
+    exp = frac - p;
+    nDigits += p - frac;
+  }
+  if(nDigits == 0)
+    return p == digits && p < end && ((*p|0x20) == 'i' || (*p|0x20) == 'n') ? parseSpecial(start, end, v) : NULL;
+
+  // exponent, where scanf also consumes an exponent without digits
+  if(p < end && (*p|0x20) == 'e') {
+    bool negExp = false;
+    int e = 0;
+    p++;
+    if(p < end && (*p == '-' || *p == '+'))
+      negExp = *p++ == '-';
+    for(; p < end && isDigit(*p); p++)
+      if(e < 100000)
+        e = e*10 + (*p - '0');
+    exp += negExp ? -e : e;
+  }
+
+  if(nDigits <= MAX_DIGITS && m <= MAX_EXACT && exp >= -22 && exp <= 22)
+    *v = exp < 0 ? (double)m/pow10[-exp] : (double)m*pow10[exp];
+  else {
+    // strtod stops at the end of the number decoded above
+    *v = strtod(start, NULL);
+    return p;
+  }
+  if(neg)
+    *v = -*v;
+  return p;
+}
+
+// parseWord copies in w the at most max non white space characters at p,
+// after optional white spaces, as the scanf %<max>s conversion. w must hold
+// max+1 bytes. Returns a pointer after the word, or NULL if there is no
+// word before end.
+char* parseWord(char *p, char *end, char *w, int max) {
+  p = skipSpaces(p, end);
+  if(p == end || *p == '\0')
+    return NULL;
+  int n = 0;
+  while(n < max && p < end && !isSpace(*p) && *p != '\0')
+    w[n++] = *p++;
+  w[n] = '\0';
+  return p;
+}
+
+// parseChannel decodes the parameters of a channel in a SPRM request as
+// sscanf(p, ", %d %3s %lg %lg %lg %lg", ch, type, v, v+1, v+2, v+3). It
+// returns the number of decoded fields, 0 if none, and stores in next a
+// pointer after the last decoded field.
+int parseChannel(char *p, char *end, int *ch, char type[4], double v[4], char **next) {
+  *next = p;
+  if(p == end || *p != ',' || (p = parseInt(p+1, end, ch)) == NULL)
+    return 0;
+  *next = p;
+  if((p = parseWord(p, end, type, 3)) == NULL)
+    return 1;
+  *next = p;
+  for(int i = 0; i < 4; i++) {
+    if((p = parseDouble(p, end, v+i)) == NULL)
+      return 2+i;
+    *next = p;
+  }
+  return 6;
+}
@@ -0,0 +1,35 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+// The request parser decodes the numbers and words of the text requests
+// in place in the receive buffer, in a single pass and without allocation.
+// The fields are matched as with the scanf conversions they replace, but
+// the parser never reads beyond the end of the request. Decimal numbers
+// with at most 19 digits and a power of ten in [-22,22] are converted
+// exactly with one floating point operation (Clinger's fast path). The
+// other ones are converted with strtod, and the hexadecimal, infinite and
+// nan values with sscanf.
+
+// parseInt decodes the integer at p, after optional white spaces, as the
+// scanf %d conversion. It stores it in v and returns a pointer after it,
+// or NULL if there is no integer before end.
+char* parseInt(char *p, char *end, int *v);
+
+// parseDouble decodes the floating point number at p, after optional
+// white spaces, as the scanf %lg conversion. It stores it in v and
+// returns a pointer after it, or NULL if there is no number before end.
+char* parseDouble(char *p, char *end, double *v);
+
+// parseWord copies in w the at most max non white space characters at p,
+// after optional white spaces, as the scanf %<max>s conversion. w must hold
+// max+1 bytes. Returns a pointer after the word, or NULL if there is no
+// word before end.
+char* parseWord(char *p, char *end, char *w, int max);
+
+// parseChannel decodes the parameters of a channel in a SPRM request as
+// sscanf(p, ", %d %3s %lg %lg %lg %lg", ch, type, v, v+1, v+2, v+3). It
+// returns the number of decoded fields, 0 if none, and stores in next a
+// pointer after the last decoded field.
+int parseChannel(char *p, char *end, int *ch, char type[4], double v[4], char **next);
+
+#endif // PARSE_H
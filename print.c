@@ -2,40 +2,188 @@
 #include "print.h"
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// logMsg_t is a cell of the ring. Its seq is the position of the cell
+// when it is free, and the position + 1 once its message was written.
+// A producer claims the cell at logHead with a compare and swap, and
+// the writer frees it by adding LOG_SIZE to seq.
+typedef struct {
+  atomic_uint seq;          // sequence number of the cell
+  int level;                // level of the message
+  struct timespec time;     // CLOCK_REALTIME time of the message
+  char msg[LOG_MSG_SIZE];   // message
+} logMsg_t;
 
-void printTime(FILE* f) {
+logMsg_t logRing[LOG_SIZE];               // ring of messages
+atomic_uint logHead;                      // position of the next message to log
+unsigned logTail;                         // position of the next message to write (logMutex)
+atomic_int logLevel = LOG_INFO;           // minimum level of the logged messages
+atomic_uint_fast64_t logDropped;          // number of messages dropped because the ring was full
+uint64_t logReported;                     // number of dropped messages already reported (logMutex)
+FILE *logFile;                            // log file, NULL for stdout and stderr (logMutex)
+pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER; // held while writing the messages
+pthread_once_t logOnce = PTHREAD_ONCE_INIT;
+bool logAsync;                            // false when the writer thread couldn't be started
+time_t logSec = -1;                       // second of the cached time prefix (logMutex)
+char logPrefix[32];                       // cached time prefix (logMutex)
+
+static const char *levelNames[] = {"debug", "info", "warn", "error"};
+
+// logWrite writes the message msg of the given level logged at time t.
+static void logWrite(int level, const struct timespec *t, const char *msg) {
+  FILE *f = logFile != NULL ? logFile : level >= LOG_WARN ? stderr : stdout;
+  if(t->tv_sec != logSec) {
+    struct tm tm;
+    localtime_r(&t->tv_sec, &tm);
+    strftime(logPrefix, sizeof(logPrefix), "%Y%m%d %H:%M:%S", &tm);
+    logSec = t->tv_sec;
+  }
+  fprintf(f, "%s.%03ld %s", logPrefix, t->tv_nsec/1000000, msg);
+}
+
+// logFlush writes the messages still in the ring. It is called at exit.
+void logFlush() {
+  pthread_mutex_lock(&logMutex);
+  int n = 0;
+  while(1) {
+    logMsg_t *m = logRing + (logTail & (LOG_SIZE-1));
+    if(atomic_load_explicit(&m->seq, memory_order_acquire) != logTail+1)
+      break;
+    logWrite(m->level, &m->time, m->msg);
+    atomic_store_explicit(&m->seq, logTail+LOG_SIZE, memory_order_release);
+    logTail++;
+    n++;
+  }
+  uint64_t dropped = atomic_load(&logDropped);
+  if(dropped != logReported) {
     struct timespec t;
     clock_gettime(CLOCK_REALTIME, &t);
-    struct tm* tm_info = localtime(&t.tv_sec);
-    char buffer[64];
-    strftime(buffer, sizeof(buffer), "%Y%m%d %H:%M:%S", tm_info);
-    fprintf(f, "%s.%03ld ", buffer,  t.tv_nsec/1000000);
+    char msg[64];
+    snprintf(msg, sizeof(msg), "log warning: %llu messages dropped\n", (unsigned long long)(dropped - logReported));
+    logWrite(LOG_WARN, &t, msg);
+    logReported = dropped;
+    n++;
+  }
+  if(n > 0) {
+    fflush(stdout);
+    fflush(stderr);
+    if(logFile != NULL)
+      fflush(logFile);
+  }
+  pthread_mutex_unlock(&logMutex);
+}
+
+// logWriter is the thread writing the logged messages.
+static void* logWriter(void *dummy) {
+  (void)dummy;
+  while(1) {
+    logFlush();
+    usleep(10000);
+  }
+  return NULL;
+}
+
+// logStart initializes the ring and starts the writer thread. When it
+// can't be started, the callers write their message themselves.
+static void logStart() {
+  for(unsigned i = 0; i < LOG_SIZE; i++)
+    atomic_init(&logRing[i].seq, i);
+  pthread_t thid;
+  logAsync = pthread_create(&thid, NULL, logWriter, NULL) == 0;
+  if(logAsync)
+    pthread_detach(thid);
+  atexit(logFlush);
+}
+
+// logMessage formats the message in a free cell of the ring, or drops it
+// if the ring is full.
+static void logMessage(int level, const char *format, va_list argp) {
+  if(level < atomic_load_explicit(&logLevel, memory_order_relaxed))
+    return;
+  pthread_once(&logOnce, logStart);
+  unsigned pos = atomic_load_explicit(&logHead, memory_order_relaxed);
+  logMsg_t *m;
+  while(1) {
+    m = logRing + (pos & (LOG_SIZE-1));
+    int dif = (int)(atomic_load_explicit(&m->seq, memory_order_acquire) - pos);
+    if(dif == 0) {
+      if(atomic_compare_exchange_weak_explicit(&logHead, &pos, pos+1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if(dif < 0) {
+      atomic_fetch_add_explicit(&logDropped, 1, memory_order_relaxed);
+      return;
+    } else
+      pos = atomic_load_explicit(&logHead, memory_order_relaxed);
+  }
+  clock_gettime(CLOCK_REALTIME, &m->time);
+  m->level = level;
+  if(vsnprintf(m->msg, LOG_MSG_SIZE, format, argp) >= LOG_MSG_SIZE)
+    memcpy(m->msg+LOG_MSG_SIZE-5, "...\n", 5);
+  atomic_store_explicit(&m->seq, pos+1, memory_order_release);
+  if(!logAsync)
+    logFlush();
+}
+
+// logSetLevel sets the log level from its name: debug, info, warn or
+// error. Returns -1 if the name is invalid.
+int logSetLevel(const char *name) {
+  for(int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+    if(strcmp(name, levelNames[i]) == 0) {
+      atomic_store(&logLevel, i);
+      return 0;
+    }
+  }
+  printErr("logSetLevel: invalid level \"%s\"\n", name);
+  return -1;
+}
+
+// logOpen appends all the following messages to the file path instead of
+// writing them to stdout and stderr. Returns -1 if it fails.
+int logOpen(const char *path) {
+  FILE *f = fopen(path, "a");
+  if(f == NULL) {
+    printErr("logOpen: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  logFlush();
+  pthread_mutex_lock(&logMutex);
+  logFile = f;
+  pthread_mutex_unlock(&logMutex);
+  return 0;
+}
+
+void logPrint(int level, const char *format, ...) {
+  va_list argp;
+  va_start(argp, format);
+  logMessage(level, format, argp);
+  va_end(argp);
 }
 
 void print(const char *format, ...) {
-  pthread_mutex_lock(&mutex);
-  printTime(stdout);
   va_list argp;
   va_start(argp, format);
-  vprintf(format, argp);
-  fflush(stdout);
-  pthread_mutex_unlock(&mutex);
+  logMessage(LOG_INFO, format, argp);
+  va_end(argp);
+}
+
+void printWarn(const char *format, ...) {
+  va_list argp;
+  va_start(argp, format);
+  logMessage(LOG_WARN, format, argp);
+  va_end(argp);
 }
 
 void printErr(const char *format, ...) {
-  pthread_mutex_lock(&mutex);
-  printTime(stderr);
   va_list argp;
   va_start(argp, format);
-  vfprintf(stderr, format, argp);
-  fflush(stderr);
-  pthread_mutex_unlock(&mutex);
+  logMessage(LOG_ERROR, format, argp);
+  va_end(argp);
 }
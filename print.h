@@ -1,12 +1,54 @@
 #ifndef PRINT_H
 #define PRINT_H
 
-// print is a thread safe and unbuffered print to stdout.
+#include <stdint.h>
+#include <stdatomic.h>
+
+// The logger is asynchronous. The callers format their message in a cell
+// of a lock free multiple producer single consumer ring, without lock nor
+// system call, and a writer thread prefixes them with their time and
+// writes them to stdout and stderr, or to the log file. Messages below
+// the log level are ignored, and messages logged when the ring is full
+// are dropped and counted so that a burst of messages never blocks the
+// callers. The messages still in the ring are written at exit.
+
+#define LOG_DEBUG 0 // debugging messages
+#define LOG_INFO  1 // normal operation messages
+#define LOG_WARN  2 // rejected connections and requests
+#define LOG_ERROR 3 // failures
+
+#define LOG_SIZE 1024    // number of messages in the ring, must be a power of 2
+#define LOG_MSG_SIZE 248 // maximum length of a message, longer ones are truncated
+
+extern atomic_int logLevel;                // minimum level of the logged messages
+extern atomic_uint_fast64_t logDropped;    // number of messages dropped because the ring was full
+
+// logSetLevel sets the log level from its name: debug, info, warn or
+// error. Returns -1 if the name is invalid.
+int logSetLevel(const char *name);
+
+// logOpen appends all the following messages to the file path instead of
+// writing them to stdout and stderr. Returns -1 if it fails.
+int logOpen(const char *path);
+
+// logFlush writes the messages still in the ring. It is called at exit.
+void logFlush();
+
+// logPrint logs a message of the given level. Messages of level LOG_WARN
+// and above go to stderr, the others to stdout. A newline is not
+// automatically appended.
+void logPrint(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// print logs a message of level LOG_INFO to stdout.
+// A newline is not automatically appended.
+void print(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// printWarn logs a message of level LOG_WARN to stderr.
 // A newline is not automatically appended.
-void print(const char *format, ...);
+void printWarn(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
-// printErr is a thread safe and unbuffered print to stderr.
+// printErr logs a message of level LOG_ERROR to stderr.
 // A newline is not automatically appended.
-void printErr(const char *format, ...);
+void printErr(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
-#endif // PRINT_H
\ No newline at end of file
+#endif // PRINT_H
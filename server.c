@@ -1,9 +1,12 @@
+#define _GNU_SOURCE // accept4
 #include "server.h"
 #include "command.h"
 #include "thread.h"
 #include "hexdump.h"
 #include "generator.h"
 #include "print.h"
+#include "observer.h"
+#include "clock.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +15,11 @@
 #include <sys/types.h> 
 #include <sys/time.h> 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
@@ -26,17 +34,154 @@ conn_t newConn, conn;
 void reset(conn_t *c) {
   c->fd = -1;
   c->len = 0;
+  c->proto = PROTO_TEXT;
   c->beg = c->end = 0;
+  c->msg = c->req;
+  c->timerFd = -1;
   c->addrStr[0] = '\0';
 }
 
-// setTimeOut for reading
-int setTimeOut(conn_t *c,int ms) {
-  // print("debug: setTimeOut: fd=%d ms=%d\n", c->fd, ms);
-  struct timeval tv;
-  tv.tv_sec = ms/1000;
-  tv.tv_usec = 1000*(ms%1000);
-  return setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+// armTimer arms the timerfd *fd to expire every ms milliseconds, creating
+// it if *fd is -1. When ms is 0, it closes the timerfd and sets *fd to -1.
+// Returns -1 if it fails.
+int armTimer(int *fd, int ms) {
+  if(ms == 0) {
+    if(*fd >= 0)
+      close(*fd);
+    *fd = -1;
+    return 0;
+  }
+  if(*fd < 0 && (*fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+    printErr("armTimer error: timerfd_create: %s\n", strerror(errno));
+    return -1;
+  }
+  struct timespec t = {ms/1000, (ms%1000)*1000000};
+  struct itimerspec it = {t, t};
+  if(timerfd_settime(*fd, 0, &it, NULL) < 0) {
+    printErr("armTimer error: timerfd_settime: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// subscribe pushes a telemetry line on the connection c every ms 
+// milliseconds while it waits for requests, or stops the pushes when ms
+// is 0. Returns -1 if it fails.
+int subscribe(conn_t *c, int ms) {
+  return armTimer(&c->timerFd, ms);
+}
+
+// pushTelemetry queues the telemetry line if the telemetry timer of c
+// expired, and sends it with the queued responses. Returns a value <= 0
+// in case of error.
+static int pushTelemetry(conn_t *c) {
+  uint64_t expirations;
+  if(read(c->timerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return 1;
+  static stats_t s; // only used by the command handler
+  char buf[BUFFER_SIZE];
+  buf[0] = '*';
+  int n = formatTelemetry(buf+1, sizeof(buf)-2, &s);
+  if(n < 0)
+    return -2;
+  buf[n+1] = '\n';
+  int res = sendBuf(c, buf, n+2);
+  return res <= 0 ? res : flushRsp(c);
+}
+
+// waitReq waits until data is received on the connection c, pushing the
+// telemetry lines meanwhile when push is true. When ms >= 0, it fails if
+// no data is received within ms milliseconds. Returns a value <= 0 in 
+// case of error.
+static int waitReq(conn_t *c, int ms, bool push) {
+  uint64_t deadline = clockNanos() + (uint64_t)ms*1000000;
+  while(1) {
+    struct pollfd pfd[2] = {{.fd = c->fd, .events = POLLIN}, {.fd = c->timerFd, .events = POLLIN}};
+    int left = -1;
+    if(ms >= 0) {
+      int64_t ns = deadline - clockNanos();
+      left = ns <= 0 ? 0 : (ns + 999999)/1000000;
+    }
+    int res = poll(pfd, push && c->timerFd >= 0 ? 2 : 1, left);
+    if(res < 0 && errno == EINTR)
+      continue;
+    if(res <= 0) {
+      printErr("recvReq error: %s\n", res == 0 ? "timeout" : strerror(errno));
+      return -1;
+    }
+    if(pfd[0].revents != 0)
+      return 1;
+    if((res = pushTelemetry(c)) <= 0)
+      return res;
+  }
+}
+
+// writeAll writes the cnt buffers of iov with as few writev as possible.
+// Returns the number of bytes written, 0 if the connection is closed, or
+// -1 in case of error.
+static int writeAll(conn_t *c, struct iovec *iov, int cnt) {
+  int total = 0;
+  while(cnt > 0) {
+    ssize_t n = writev(c->fd, iov, cnt);
+    if(n <= 0) {
+      if(n == -1)
+        printErr("sendRsp error: %s\n", strerror(errno));
+      return n;
+    }
+    total += n;
+    // skip the written buffers
+    while(cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if(cnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return total;
+}
+
+// flushRsp sends the queued responses. Returns the number of bytes sent,
+// 0 if the connection is closed, or -1 in case of error. 
+int flushRsp(conn_t *c) {
+  if(c->len == 0)
+    return 1;
+  // print("debug: flushRsp: \n");
+  // hexdump(c->rsp, c->len);
+  struct iovec iov = {c->rsp, c->len};
+  c->len = 0;
+  return writeAll(c, &iov, 1);
+}
+
+// fill sends the queued responses, and then reads data in the request
+// buffer. The received data is moved at the start of the buffer when less 
+// than need bytes would be available after its start. When ms >= 0, it 
+// fails if no data is received within ms milliseconds. The telemetry 
+// lines are pushed while it waits only when push is true. Returns the 
+// number of bytes read, 0 if the connection is closed, -1 in case of error.
+static int fill(conn_t *c, int need, int ms, bool push) {
+  int res;
+  if((res = flushRsp(c)) <= 0)
+    return res;
+  if(c->beg == c->end)
+    c->beg = c->end = 0;
+  else if(c->end == BUFFER_SIZE || c->beg + need > BUFFER_SIZE) {
+    c->end -= c->beg;
+    memmove(c->req, c->req+c->beg, c->end);
+    c->beg = 0;
+  }
+  if((ms >= 0 || (push && c->timerFd >= 0)) && (res = waitReq(c, ms, push)) <= 0)
+    return res;
+  ssize_t n = read(c->fd, c->req+c->end, BUFFER_SIZE - c->end);
+  if(n <= 0) {
+    if(n == -1)
+      printErr("recvReq error: %s\n", strerror(errno));
+    return n;
+  }
+  c->end += n;
+  return n;
 }
 
 // recvReq reads next text line ending with \n. Returns the string
@@ -44,116 +189,121 @@ int setTimeOut(conn_t *c,int ms) {
 // case of read error, -2 in case the buffer would overflow. A 
 // return value <= 0 is a fatal error. The connection should be 
 // closed and the buffer reset.
+//
+// The request is at c->msg and remains valid until the next call to 
+// recvReq or recvBuf. Requests already received are returned without 
+// reading. The queued responses are sent before blocking on a read, 
+// so that responses of pipelined requests are sent in one write. 
 int recvReq(conn_t *c) {
-  // pop previous request if any
-  if(c->beg != 0) {
-    c->end -= c->beg;
-    if(c->end > 0)
-      memmove(c->req, c->req+c->beg, c->end);
-    c->beg = 0;
-  }
-  // check if there is already a full line in buffer
-  while(c->beg < c->end && c->req[c->beg] != '\n')
-    c->beg++;
-  if(c->beg < c->end) {
-    // we found a \n at indice c->beg, include also the \n
-    c->beg++;
-    //print("debug: received request:\n");
-    //hexdump(c->req, c->beg-c->req);
-    return c->beg;
-  }
-  bool start = c->beg == 0;
+  int scan = c->beg;
   while(1) {
-    if(c->end == BUFFER_SIZE)
-      return -2;
-    if(start)
-      // no timout, wait forever
-      start = false;
-    else
-      setTimeOut(c, 500);
-    ssize_t n = read(c->fd, c->req+c->end, BUFFER_SIZE - c->end);
-    if(n <= 0) {
-      if(n == -1) {
-        //print("debug: recvReq: read error %d\n", errno);
-        printErr("recvReq error: %s\n", strerror(errno));
-      }
+    char *nl = memchr(c->req+scan, '\n', c->end-scan);
+    if(nl != NULL) {
+      // include also the \n
+      c->msg = c->req+c->beg;
+      int n = nl+1 - c->msg;
+      c->beg += n;
+      //print("debug: received request:\n");
+      //hexdump(c->msg, n);
       return n;
     }
-    setTimeOut(c, 0);
-    c->end += n;
-    while(c->beg < c->end && c->req[c->beg] != '\n')
-      c->beg++;
-    if(c->beg < c->end) {
-      // we found a \n at indice c->beg, include also the \n
-      c->beg++;
-      // print("received request:\n");
-      // hexdump(c->req, c->beg-c->req);
-      return c->beg;
-    }
+    int pending = c->end - c->beg;
+    if(pending == BUFFER_SIZE)
+      return -2;
+    // wait forever for a new request, and 500ms for the end of a request
+    int n = fill(c, pending+1, pending == 0 ? -1 : 500, true);
+    if(n <= 0)
+      return n;
+    scan = c->end - n;
   }
 }
 
-// sendRspBuf sends the first len bytes of rspBuf and returns
-// len, 0 or -1. When not len, the connection must be closed.
-// Appends a \n if there is none.
-int sendRspBuf(conn_t *c) {
-  if(c->len <= 0) {
-    printErr("sendRspBuf: response buffer is empty (%d)\n", c->len);
+// recvBuf reads until at least n bytes are buffered. The n bytes are at
+// c->msg and remain valid until the next call to recvReq or recvBuf. 
+// The telemetry lines are not pushed meanwhile, so that they are never
+// interleaved with binary data such as stream frames. Returns n if 
+// positive, 0 if the connection has been closed, -1 in case of read 
+// error, -2 if n is bigger than the buffer size. A return value <= 0 is
+// a fatal error.
+int recvBuf(conn_t *c, int n) {
+  if(n > BUFFER_SIZE)
     return -2;
+  while(c->end - c->beg < n) {
+    int r = fill(c, n, -1, false);
+    if(r <= 0)
+      return r;
   }
-  // append \n if missing
-  if(c->len == 0 || c->rsp[c->len-1] != '\n') {
-    if(c->len >= BUFFER_SIZE-2) {
-       return -3;
-    }
-    strcpy(c->rsp+c->len++, "\n");
-  }
-  // print("debug: sendRspBuf: \n");
-  // hexdump(c->rsp, c->len);
-  char *p = c->rsp;
-  while(c->len > 0) {
-    ssize_t n = write(c->fd, p, c->len);
-    if(n <= 0) {
-      if(n == -1)
-        printErr("sendRsp error: %s\n", strerror(errno));
+  c->msg = c->req+c->beg;
+  c->beg += n;
+  return n;
+}
+
+// queueRsp appends the tag followed by the formatted message to the queued
+// responses. It appends a '\n' if it is missing. The queued responses are 
+// sent first if there is not enough room left. Returns the number of bytes
+// queued, or a value <= 0 in case of error.
+static int queueRsp(conn_t *c, char tag, const char *format, va_list argp) {
+  while(1) {
+    va_list ap;
+    va_copy(ap, argp);
+    int size = BUFFER_SIZE - c->len - 1;
+    int n = vsnprintf(c->rsp+c->len+1, size, format, ap);
+    va_end(ap);
+    if(n < 0)
       return n;
+    if(n < size) {
+      char *p = c->rsp+c->len;
+      p[0] = tag;
+      if(n == 0 || p[n] != '\n')
+        p[++n] = '\n';
+      c->len += n+1;
+      return n+1;
     }
-    p += n;
-    c->len -= n;
+    if(c->len == 0)
+      return -2;
+    int res = flushRsp(c);
+    if(res <= 0)
+      return res;
   }
-  return p - c->rsp;
 }
 
-// sendRsp sends the string (ending with '\0'). It appends a '\n' if it is
-// missing. Return 0 when the connection is closed, -1 in case of error,
-// -2 if the buffer would overflow. Otherwise returns the number of lines
-// written. It will be bigger than the input string length when a newline
-// had to be appended.
+// sendRsp queues the string (ending with '\0') prefixed with '>'. It 
+// appends a '\n' if it is missing. Return 0 when the connection is closed,
+// -1 in case of error, -2 if the buffer would overflow. Otherwise returns
+// the number of bytes queued. The queued responses are sent by the next 
+// receive, or by flushRsp.
 int sendRsp(conn_t *c, const char *format, ...) {
-  strcpy(c->rsp, ">");
-  c->len = 1;
   va_list argp;
   va_start(argp, format);
-  int n = vsnprintf(c->rsp+1, BUFFER_SIZE-1, format, argp);
-  if(n >= BUFFER_SIZE-1)
-    return -2;
-  if(n < 0)
-    return n;
-  c->len += n;
-  return sendRspBuf(c);
+  int n = queueRsp(c, '>', format, argp);
+  va_end(argp);
+  return n;
+}
+
+// sendBuf queues the len bytes of buf as is. Return 0 when the connection
+// is closed, -1 in case of error, otherwise len. Buffers too big to be 
+// queued are sent immediately with the queued responses.
+int sendBuf(conn_t *c, const void *buf, int len) {
+  if(len <= BUFFER_SIZE - c->len) {
+    memcpy(c->rsp+c->len, buf, len);
+    c->len += len;
+    return len;
+  }
+  struct iovec iov[2] = {{c->rsp, c->len}, {(void*)buf, len}};
+  int n = c->len;
+  c->len = 0;
+  int res = writeAll(c, iov, 2);
+  return res <= 0 ? res : res - n;
 }
 
-// sendError sends an error message. Appends '\n' if missing.
+// sendError queues an error message prefixed with '!'. Appends '\n' if 
+// missing.
 int sendError(conn_t *c, const char *format, ...) {
-  strcpy(c->rsp, "!");
-  c->len = 1;
   va_list argp;
   va_start(argp, format);
-  int n = vsnprintf(c->rsp+1, BUFFER_SIZE-1, format, argp);
-  if(n >= BUFFER_SIZE-1)
-    return -2;
-  c->len += n;
-  return sendRspBuf(c);
+  int n = queueRsp(c, '!', format, argp);
+  va_end(argp);
+  return n;
 }
 
 // close the current connection.
@@ -162,6 +312,7 @@ void closeConn(conn_t *c) {
     // print("debug: closeConn: fd=%d\n", c->fd);
     close(c->fd);
   }
+  armTimer(&c->timerFd, 0);
   reset(c);
 }
 
@@ -178,6 +329,156 @@ int addrToString(struct sockaddr_in *addr, char *buf, size_t maxLen) {
   return 0;
 }
 
+// pending_t is a connection waiting for its greeting.
+typedef struct {
+  int fd;             // -1 when the slot is free
+  uint64_t deadline;  // time in ns after which the connection is rejected
+  int len;            // number of bytes in buf
+  char buf[256];      // received data
+  char addrStr[64];
+} pending_t;
+
+pending_t pending[MAX_PENDING];
+
+// closePending closes the pending connection p and frees its slot.
+static void closePending(pending_t *p) {
+  close(p->fd);
+  p->fd = -1;
+}
+
+// welcome answers the greeting of the pending connection p and passes it
+// to the command handler or the observer thread, or rejects it if there
+// is already an active controller connection. The greeting is the first
+// n bytes of the received data.
+static void welcome(pending_t *p, int n, int proto) {
+  reset(&newConn);
+  newConn.fd = p->fd;
+  newConn.proto = proto;
+  memcpy(newConn.req, p->buf, p->len);
+  newConn.beg = n;
+  newConn.end = p->len;
+  strcpy(newConn.addrStr, p->addrStr);
+  p->fd = -1;
+  // the command handler uses blocking reads
+  int flags = fcntl(newConn.fd, F_GETFL);
+  if(flags < 0 || fcntl(newConn.fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    printWarn("serve warning: fcntl: %s, reject connection from %s\n", strerror(errno), newConn.addrStr);
+    closeConn(&newConn);
+    return;
+  }
+  if(proto == PROTO_OBSERVER) {
+    // observers don't need the controller connection
+    if(sendRsp(&newConn, "HELO %s %dbits\n", version, bitsResolution) <= 0 ||
+        flushRsp(&newConn) <= 0 || observerAdd(&newConn) < 0)
+      printWarn("serve warning: failed adding observer, reject connection from %s\n", newConn.addrStr);
+    closeConn(&newConn);
+    return;
+  }
+  if(!atomic_flag_test_and_set(&isConnected)) {
+    // we are available, start command handler
+    if(sendRsp(&newConn, "HELO %s %dbits\n", version, bitsResolution) <= 0 || flushRsp(&newConn) <= 0) {
+      printWarn("serve warning: failed replying to greeting, reject connection from %s\n", newConn.addrStr);
+      atomic_flag_clear(&isConnected);
+      closeConn(&newConn);
+      return;
+    }
+    // print("server info: accept connection from %s\n", newConn.addrStr);
+    reset(&conn);
+    conn.fd = newConn.fd;
+    conn.proto = newConn.proto;
+    // keep the requests pipelined after the greeting
+    conn.end = newConn.end - newConn.beg;
+    memcpy(conn.req, newConn.req+newConn.beg, conn.end);
+    newConn.fd = -1;
+    // print("debug: serve: fd=%d\n", conn.fd);
+    strcpy(conn.addrStr, newConn.addrStr);
+    startThread(&commandHandler);
+    return;
+  }
+  // we are busy, return notification and close connection
+  printWarn("serve warning: busy, reject connection from %s\n", newConn.addrStr);
+  sendError(&newConn, "busy with %s", conn.addrStr);
+  flushRsp(&newConn);
+  closeConn(&newConn);
+}
+
+// handshake reads the data received on the pending connection p, and 
+// handles its greeting once it is complete.
+static void handshake(pending_t *p) {
+  ssize_t n = read(p->fd, p->buf+p->len, sizeof(p->buf)-p->len);
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if(n <= 0) {
+    printWarn("serve warning: reject invalid connection from %s\n", p->addrStr);
+    closePending(p);
+    return;
+  }
+  p->len += n;
+  char *nl = memchr(p->buf, '\n', p->len);
+  if(nl == NULL) {
+    if(p->len == sizeof(p->buf)) {
+      printWarn("serve warning: reject invalid connection from %s\n", p->addrStr);
+      closePending(p);
+    }
+    return;
+  }
+  int len = nl+1 - p->buf;
+  if(len == 5 && memcmp(p->buf, "PWM0\n", 5) == 0)
+    welcome(p, len, PROTO_TEXT);
+  else if(len == 5 && memcmp(p->buf, "PWM1\n", 5) == 0)
+    welcome(p, len, PROTO_BINARY);
+  else if(len == 5 && memcmp(p->buf, "PWMR\n", 5) == 0)
+    welcome(p, len, PROTO_OBSERVER);
+  else {
+    printWarn("serve warning: expected \"PWM0\\n\", \"PWM1\\n\" or \"PWMR\\n\", reject connection from %s\n", p->addrStr);
+    closePending(p);
+  }
+}
+
+// acceptAll accepts all the incoming connections and adds them to the
+// pending connections waiting for their greeting. When all slots are 
+// used, the connection closest to its deadline is rejected.
+static void acceptAll(int listenFD, int epollFD) {
+  while(1) {
+    struct sockaddr_in cliAddr;
+    socklen_t cliLen = sizeof(cliAddr);
+    int fd = accept4(listenFD, (struct sockaddr *) &cliAddr, &cliLen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if(fd < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        printWarn("serve warning: accept: %s\n", strerror(errno));
+      if(errno != EINTR)
+        return;
+      continue;
+    }
+    pending_t *p = NULL;
+    for(int i = 0; i < MAX_PENDING; i++)
+      if(pending[i].fd < 0 || p == NULL || (p->fd >= 0 && pending[i].deadline < p->deadline))
+        p = pending+i;
+    if(p->fd >= 0) {
+      printWarn("serve warning: too many pending connections, reject connection from %s\n", p->addrStr);
+      closePending(p);
+    }
+    if(addrToString(&cliAddr, p->addrStr, sizeof(p->addrStr)) != 0) {
+      printWarn("serve warning: invalid client address\n");
+      close(fd);
+      continue;
+    }
+    int one = 1;
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0){
+      printWarn("serve warning: failed setting TCP_NODELAY\n");
+    }   
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = p};
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      printWarn("serve warning: epoll_ctl: %s\n", strerror(errno));
+      close(fd);
+      continue;
+    }
+    p->fd = fd;
+    p->len = 0;
+    p->deadline = clockNanos() + (uint64_t)GREETING_TIMEOUT*1000000;
+  }
+}
+
 // The server function blocks forever handling connection requests. 
 // Incomming connections requests are silently discarded if they don't 
 // send a valid request or timeout. If the request is valid and there
@@ -185,6 +486,10 @@ int addrToString(struct sockaddr_in *addr, char *buf, size_t maxLen) {
 // Otherwise the server returns an error response giving the address
 // of the remote connected host.
 //
+// The greetings of up to MAX_PENDING connections are awaited at once 
+// with epoll, each with its own deadline, so that a silent client 
+// doesn't delay the other connections.
+//
 // The server returns immediately if it failed to start listening. The 
 // program must then exit with an error code. 
 //
@@ -195,12 +500,14 @@ int serve(unsigned short port) {
     return 1;
   }
   newConn.fd = -1;
-  int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+  for(int i = 0; i < MAX_PENDING; i++)
+    pending[i].fd = -1;
+  int listenFD = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
   if(listenFD < 0) {
     printErr("serve error: socket: %s\n", strerror(errno));
     return -1;
   }
-  struct sockaddr_in servAddr, cliAddr;
+  struct sockaddr_in servAddr;
   bzero((char *) &servAddr, sizeof(servAddr));
   servAddr.sin_family = AF_INET;
   servAddr.sin_addr.s_addr = INADDR_ANY;
@@ -210,56 +517,41 @@ int serve(unsigned short port) {
     close(listenFD);
     return -1;
   }
+  int epollFD = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if(epollFD < 0 || epoll_ctl(epollFD, EPOLL_CTL_ADD, listenFD, &ev) < 0) {
+    printErr("serve error: epoll: %s\n", strerror(errno));
+    close(listenFD);
+    return -1;
+  }
+  if(observerInit() < 0)
+    printWarn("serve warning: observers are disabled\n");
   print("server info: starting and listening on port %d\n", port);
-  listen(listenFD, 5);
-  socklen_t cliLen = sizeof(cliAddr);
-  int res;
+  listen(listenFD, SOMAXCONN);
+  struct epoll_event events[MAX_PENDING];
   while(1) {
-    closeConn(&newConn);
-    newConn.fd = accept(listenFD, (struct sockaddr *) &cliAddr, &cliLen);
-    if(newConn.fd < 0) {
-       printErr("serve warning: accept: %s\n", strerror(errno));
-      continue;
-    }
-    if(addrToString(&cliAddr, newConn.addrStr, sizeof(newConn.addrStr)) != 0) {
-      printErr("serve warning: invalid client address\n");
-      continue;
-    }
-    int one = 1;
-    if(setsockopt(newConn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0){
-      printErr("serve warning: failed setting TCP_NODELAY\n");
-    }   
-    if(setTimeOut(&newConn, 10000) != 0) {
-      printErr("serve warning: set timeout: %s\n", strerror(errno));
-      continue;
-    }
-    if((res = recvReq(&newConn)) <= 0) {
-      printErr("serve warning: reject invalid connection from %s\n", newConn.addrStr);
-      continue;
-    }
-    if(res != 5 || memcmp(newConn.req, "PWM0\n", 5) != 0) {
-      printErr("serve warning: expected \"PWM0\\n\", reject connection from %s\n", newConn.addrStr);
-      continue;
-    }
-    if(!atomic_flag_test_and_set(&isConnected)) {
-      // we are available, start command handler
-      if((res = sendRsp(&newConn, "HELO %s %dbits\n", version, BITS_RESOLUTION)) <=0) {
-        printErr("serve warning: failed replying to \"PWM0\\n\", reject connection from %s\n", newConn.addrStr);
-        atomic_flag_clear(&isConnected);
+    // wait until the next deadline
+    uint64_t now = clockNanos(), next = UINT64_MAX;
+    for(int i = 0; i < MAX_PENDING; i++) {
+      if(pending[i].fd < 0)
         continue;
-      }
-      // print("server info: accept connection from %s\n", newConn.addrStr);
-      reset(&conn);
-      conn.fd = newConn.fd;
-      newConn.fd = -1;
-      // print("debug: serve: fd=%d\n", conn.fd);
-      strcpy(conn.addrStr, newConn.addrStr);
-      startThread(&commandHandler);
-      continue;
+      if(pending[i].deadline <= now) {
+        printWarn("serve warning: greeting timeout, reject connection from %s\n", pending[i].addrStr);
+        closePending(pending+i);
+      } else if(pending[i].deadline < next)
+        next = pending[i].deadline;
+    }
+    int timeout = next == UINT64_MAX ? -1 : (int)((next - now + 999999)/1000000);
+    int n = epoll_wait(epollFD, events, MAX_PENDING, timeout);
+    if(n < 0 && errno != EINTR)
+      printWarn("serve warning: epoll_wait: %s\n", strerror(errno));
+    for(int i = 0; i < n; i++) {
+      pending_t *p = events[i].data.ptr;
+      if(p == NULL)
+        acceptAll(listenFD, epollFD);
+      else if(p->fd >= 0)
+        handshake(p);
     }
-    // we are busy, return notification and close connection
-    printErr("serve warning: busy, reject connection from %s\n", newConn.addrStr);
-    sendError(&newConn, "busy with %s", newConn.addrStr);
   }
   return -1;
 }
@@ -6,13 +6,25 @@
 #include <stdint.h>
 
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 4096
+
+#define MAX_PENDING 64        // maximum number of connections waiting for their greeting
+#define GREETING_TIMEOUT 10000 // time in ms given to send the greeting
+#define SUBS_MIN_INTERVAL 10      // minimum telemetry push interval in ms
+#define SUBS_MAX_INTERVAL 3600000 // maximum telemetry push interval in ms
+
+#define PROTO_TEXT   0 // text protocol selected with the PWM0 greeting
+#define PROTO_BINARY 1 // binary protocol selected with the PWM1 greeting
+#define PROTO_OBSERVER 2 // read-only text protocol selected with the PWMR greeting
 
 typedef struct {
   int fd, len;
-  char rsp[BUFFER_SIZE];
-  char req[BUFFER_SIZE];
-  uint16_t beg, end;
+  int proto;        // PROTO_TEXT, PROTO_BINARY or PROTO_OBSERVER
+  char rsp[BUFFER_SIZE]; // queued responses, len is their size
+  char req[BUFFER_SIZE]; // received data
+  char *msg;        // last received request
+  uint16_t beg, end; // unprocessed received data is in req[beg:end]
+  int timerFd;      // timerfd of the telemetry pushes, -1 if not subscribed
   char addrStr[256];
 } conn_t;
 
@@ -22,26 +34,56 @@ extern atomic_flag isConnected; // set when connection is active
 // resets the connection connection
 void reset(conn_t *c);
 
-// setTimeOut for reading
-int setTimeOut(conn_t *c,int ms);
-
 // recvReq reads next text line ending with \n. Returns the string
 // length if positive, 0 if the connection has been closed, -1 in
 // case of read error, -2 in case the buffer would overflow. A 
 // return value <= 0 is a fatal error. The connection should be 
 // closed and the buffer reset.
+//
+// The request is at c->msg and remains valid until the next call to 
+// recvReq or recvBuf. Requests already received are returned without 
+// reading. The queued responses are sent before blocking on a read, 
+// so that responses of pipelined requests are sent in one write. 
+// The telemetry lines are pushed while waiting for the request.
 int recvReq(conn_t *c);
 
-// sendRsp sends the string (ending with '\0'). It appends a '\n' if it is
-// missing. Return 0 when the connection is closed, -1 in case of error,
-// -2 if the buffer would overflow. Otherwise returns the number of lines
-// written. It will be bigger than the input string length when a newline
-// had to be appended.
+// recvBuf reads until at least n bytes are buffered. The n bytes are at
+// c->msg and remain valid until the next call to recvReq or recvBuf. 
+// Returns n if positive, 0 if the connection has been closed, -1 in case
+// of read error, -2 if n is bigger than the buffer size. A return value
+// <= 0 is a fatal error.
+int recvBuf(conn_t *c, int n);
+
+// sendRsp queues the string (ending with '\0') prefixed with '>'. It 
+// appends a '\n' if it is missing. Return 0 when the connection is closed,
+// -1 in case of error, -2 if the buffer would overflow. Otherwise returns
+// the number of bytes queued. The queued responses are sent by the next 
+// receive, or by flushRsp.
 int sendRsp(conn_t *c, const char *format, ...);
 
-// sendError sends an error message. Appends '\n' if missing.
+// sendBuf queues the len bytes of buf as is. Return 0 when the connection
+// is closed, -1 in case of error, otherwise len. Buffers too big to be 
+// queued are sent immediately with the queued responses.
+int sendBuf(conn_t *c, const void *buf, int len);
+
+// sendError queues an error message prefixed with '!'. Appends '\n' if 
+// missing.
 int sendError(conn_t *c, const char *format, ...);
 
+// armTimer arms the timerfd *fd to expire every ms milliseconds, creating
+// it if *fd is -1. When ms is 0, it closes the timerfd and sets *fd to -1.
+// Returns -1 if it fails.
+int armTimer(int *fd, int ms);
+
+// subscribe pushes a telemetry line on the connection c every ms 
+// milliseconds while it waits for requests, or stops the pushes when ms
+// is 0. Returns -1 if it fails.
+int subscribe(conn_t *c, int ms);
+
+// flushRsp sends the queued responses. Returns the number of bytes sent,
+// 0 if the connection is closed, or -1 in case of error. 
+int flushRsp(conn_t *c);
+
 // close the current connection.
 void closeConn(conn_t *c);
 
@@ -52,6 +94,10 @@ void closeConn(conn_t *c);
 // Otherwise the server returns an error response giving the address
 // of the remote connected host.
 //
+// The greetings of up to MAX_PENDING connections are awaited at once 
+// with epoll, each with its own deadline, so that a silent client 
+// doesn't delay the other connections.
+//
 // The server returns immediately if it failed to start listening. The 
 // program must then exit with an error code. 
 //
@@ -0,0 +1,227 @@
+#include "shm.h"
+#include "command.h"
+#include "server.h"
+#include "generator.h"
+#include "stream.h"
+#include "stats.h"
+#include "clock.h"
+#include "thread.h"
+#include "print.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+_Static_assert(SHM_MAX_CHAN == MAX_CHAN, "SHM_MAX_CHAN must be MAX_CHAN");
+_Static_assert(sizeof(shmParams_t) == 40, "unexpected shmParams_t size");
+
+shmSegment_t *shmSeg; // mapped control segment, NULL when disabled
+int shmOwner;         // pid of the client in control, 0 if none
+
+// shmWait blocks until *addr is no longer val, it is woken up, or ms
+// milliseconds elapsed.
+static void shmWait(atomic_uint *addr, unsigned val, int ms) {
+  struct timespec t = {ms/1000, (ms%1000)*1000000};
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &t, NULL, 0);
+}
+
+// shmWake wakes up the processes waiting on *addr.
+static void shmWake(atomic_uint *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// shmPublish publishes the status and telemetry in the segment.
+static void shmPublish() {
+  static stats_t s;
+  cmdParams_t p[MAX_CHAN];
+  double mean, stdDev;
+  statsSnapshot(&s);
+  generatorFrequency(&mean, &stdDev);
+  snapshotParams(p);
+  shmSegment_t *g = shmSeg;
+  unsigned seq = atomic_load_explicit(&g->telSeq, memory_order_relaxed);
+  atomic_store_explicit(&g->telSeq, seq+1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  g->ownerPid = shmOwner;
+  g->frequencyMean = mean;
+  g->frequencyStdDev = stdDev;
+  g->skippedPeriods = s.skippedPeriods;
+  g->missedSteps = s.missedSteps;
+  g->streamUnderruns = atomic_load(&streamUnderruns);
+  g->streamOverruns = atomic_load(&streamOverruns);
+  for(int ch = 0; ch < nChan; ch++)
+    g->params[ch] = (shmParams_t){p[ch].type, {0}, p[ch].average, p[ch].amplitude, p[ch].period, p[ch].start};
+  atomic_store_explicit(&g->telSeq, seq+2, memory_order_release);
+}
+
+// shmRelease stops the generator and releases the control.
+static void shmRelease() {
+  print("stop accepting commands from %s\n", conn.addrStr);
+  stopGenerator();
+  shmOwner = 0;
+  atomic_flag_clear(&isConnected);
+}
+
+// shmUnlock releases the request when the process holding it exited. A
+// request it left half written is dropped.
+static void shmUnlock(unsigned done) {
+  shmSegment_t *g = shmSeg;
+  int pid = atomic_load(&g->reqLock);
+  if(pid == 0 || kill(pid, 0) == 0 || errno != ESRCH)
+    return;
+  unsigned seq = atomic_load(&g->reqSeq);
+  if((seq & 1) != 0)
+    atomic_compare_exchange_strong(&g->reqSeq, &seq, done);
+  if(atomic_compare_exchange_strong(&g->reqLock, &pid, 0)) {
+    printWarn("shm warning: release the request held by %d\n", pid);
+    shmWake((atomic_uint*)&g->reqLock);
+  }
+}
+
+// shmRequest handles the request of the client pid setting the parameters
+// req of the channels flagged in flags. It takes the control if needed,
+// and releases it when flags is 0. Returns NULL if it succeeds, or the
+// error message.
+static char* shmRequest(int pid, uint32_t flags, const shmParams_t req[MAX_CHAN]) {
+  static char msg[SHM_ERR_SIZE];
+  if(pid <= 0) {
+    snprintf(msg, sizeof(msg), "expect the pid of the client, got %d", pid);
+    return msg;
+  }
+  if(atomic_load(&shmSeg->reqLock) != pid) {
+    snprintf(msg, sizeof(msg), "expect the request to be claimed in reqLock");
+    return msg;
+  }
+  if(shmOwner != 0 && pid != shmOwner) {
+    snprintf(msg, sizeof(msg), "busy with %.128s", conn.addrStr);
+    return msg;
+  }
+  if(flags == 0) {
+    if(shmOwner != 0)
+      shmRelease();
+    return NULL;
+  }
+  if((flags >> nChan) != 0) {
+    snprintf(msg, sizeof(msg), "expect channels in range [0,%d], got flags 0x%x", nChan-1, flags);
+    return msg;
+  }
+  cmdParams_t newCmdParams[MAX_CHAN];
+  bool hasCmdParams[MAX_CHAN] = {0};
+  for(uint32_t m = flags; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    const shmParams_t *r = req+ch;
+    uint64_t pad = 0;
+    memcpy(&pad, r->pad, sizeof(r->pad));
+    if(r->type > ARB_PARAM || pad != 0) {
+      snprintf(msg, sizeof(msg), "channel[%d]: invalid type %d or pad", ch, r->type);
+      return msg;
+    }
+    hasCmdParams[ch] = true;
+    newCmdParams[ch] = (cmdParams_t){r->type, r->average, r->amplitude, r->period, r->start};
+  }
+  if(shmOwner == 0) {
+    if(atomic_flag_test_and_set(&isConnected)) {
+      snprintf(msg, sizeof(msg), "busy with %.128s", conn.addrStr);
+      return msg;
+    }
+    shmOwner = pid;
+    reset(&conn);
+    snprintf(conn.addrStr, sizeof(conn.addrStr), "shm:%d", pid);
+    print("start accepting commands from %s\n", conn.addrStr);
+    startGenerator();
+  }
+  return setParams(newCmdParams, hasCmdParams);
+}
+
+// shmServer is the thread serving the control segment. It handles the
+// requests as they are published and the telemetry every SHM_PERIOD ms.
+static void* shmServer(void* dummy) {
+  UNUSED(dummy);
+  shmSegment_t *g = shmSeg;
+  unsigned done = atomic_load(&g->ackSeq);
+  uint64_t next = 0;
+  while(1) {
+    unsigned seq = atomic_load_explicit(&g->reqSeq, memory_order_acquire);
+    if((seq & 1) == 0 && seq != done) {
+      shmParams_t req[MAX_CHAN];
+      int pid = g->reqPid;
+      uint32_t flags = g->reqFlags;
+      memcpy(req, g->req, sizeof(req));
+      atomic_thread_fence(memory_order_acquire);
+      if(atomic_load_explicit(&g->reqSeq, memory_order_relaxed) != seq)
+        continue; // the client wrote a new request meanwhile
+      char *err = shmRequest(pid, flags, req);
+      if(err != NULL)
+        printWarn("shm warning: request from %d: %s\n", pid, err);
+      g->ackStatus = err == NULL ? 0 : -1;
+      snprintf(g->ackErr, sizeof(g->ackErr), "%s", err == NULL ? "" : err);
+      done = seq;
+      next = 0;
+    }
+    uint64_t now = clockNanos();
+    if(now >= next) {
+      if(shmOwner != 0 && kill(shmOwner, 0) < 0 && errno == ESRCH)
+        shmRelease();
+      shmUnlock(done);
+      shmPublish();
+      next = now + SHM_PERIOD*1000000ull;
+    }
+    if(atomic_load_explicit(&g->ackSeq, memory_order_relaxed) != done) {
+      // the response is acknowledged after the telemetry of the request
+      atomic_store_explicit(&g->ackSeq, done, memory_order_release);
+      shmWake(&g->ackSeq);
+    }
+    seq = atomic_load_explicit(&g->reqSeq, memory_order_acquire);
+    if(seq == done || (seq & 1) != 0)
+      shmWait(&g->reqSeq, seq, (next - now + 999999)/1000000);
+  }
+  return NULL;
+}
+
+// shmInit creates the shared memory segment name, as for shm_open, and
+// starts the thread serving it. Returns -1 if it fails.
+int shmInit(const char *name) {
+  // a new object so that clients still mapping a previous one notice it
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0660);
+  if(fd < 0) {
+    printErr("shm error: shm_open %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  if(ftruncate(fd, sizeof(shmSegment_t)) < 0) {
+    printErr("shm error: ftruncate %s: %s\n", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  shmSegment_t *g = mmap(NULL, sizeof(shmSegment_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(g == MAP_FAILED) {
+    printErr("shm error: mmap %s: %s\n", name, strerror(errno));
+    shm_unlink(name);
+    return -1;
+  }
+  g->version = SHM_VERSION;
+  g->nChan = nChan;
+  g->bits = bitsResolution;
+  g->serverPid = getpid();
+  shmSeg = g;
+  shmPublish();
+  atomic_thread_fence(memory_order_release);
+  g->magic = SHM_MAGIC;
+  if(startThread(&shmServer) < 0) {
+    munmap(g, sizeof(shmSegment_t));
+    shm_unlink(name);
+    shmSeg = NULL;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// The shared memory control segment lets a process running on the same
+// host control the generator without the TCP connection. It is a POSIX
+// shared memory object created with the -S option, holding a request
+// written by the client, the response of the server, and the status and
+// telemetry published by the server.
+//
+// A client first claims the request by a compare and swap of reqLock from
+// 0 to its pid. When it fails, another process is using the request, and
+// the client waits on the futex of reqLock before trying again. It then 
+// increments reqSeq to an odd value, writes its pid, the flags of the 
+// channels to set and their parameters, increments reqSeq to an even 
+// value and wakes the server with a futex wake on reqSeq. The server 
+// applies the request once reqSeq is even and stable, with the same 
+// validation as SPRM, then stores reqSeq in ackSeq and wakes the futex
+// waiters on ackSeq. Once it read the response, the client stores 0 in 
+// reqLock and wakes the futex waiters on reqLock. The server rejects the
+// requests written without holding reqLock, and releases reqLock when the
+// process holding it exits.
+//
+// A request with no flags releases the control. The server takes the 
+// control at the first request, as a PWM0 connection, and keeps it until
+// it is released or the client process exits. Meanwhile PWM0 connections
+// are rejected and the requests of other processes are answered with an
+// error.
+//
+// The status and telemetry are published every SHM_PERIOD ms, and after
+// each request, under the telSeq seqlock: a copy is consistent when
+// telSeq was even and unchanged before and after it. The futexes are
+// shared between processes and must not use the private flag.
+
+#define SHM_MAGIC   0x4d575053 // "SPWM", set once the segment is initialized
+#define SHM_VERSION 1          // version of the segment layout
+#define SHM_MAX_CHAN 26        // number of channel records, as MAX_CHAN
+#define SHM_ERR_SIZE 256       // size of the error message of a rejected request
+#define SHM_PERIOD 100         // telemetry publication period in ms
+
+// shmParams_t is the layout of the parameters of a channel in the segment.
+// The pad must be 0.
+typedef struct {
+  uint8_t type;     // type of generation as in cmdParams_t
+  uint8_t pad[7];   // reserved, must be 0
+  double average;   // average (rate for ARB)
+  double amplitude; // amplitude (loop for ARB)
+  double period;    // period (count for ARB)
+  double start;     // start
+} shmParams_t;
+
+typedef struct {
+  uint32_t magic;       // SHM_MAGIC once the segment is initialized
+  uint32_t version;     // SHM_VERSION
+  uint32_t nChan;       // number of channels
+  uint32_t bits;        // pwm resolution in bits
+  int32_t serverPid;    // pid of the generator
+
+  // request written by the client
+  atomic_int reqLock;   // pid of the client using the request, 0 if none
+  atomic_uint reqSeq;   // odd while the request is written
+  int32_t reqPid;       // pid of the client
+  uint32_t reqFlags;    // channels to set, none to release the control
+  shmParams_t req[SHM_MAX_CHAN];
+
+  // response written by the server
+  atomic_uint ackSeq;   // reqSeq of the last handled request
+  int32_t ackStatus;    // 0 if the request succeeded, -1 otherwise
+  char ackErr[SHM_ERR_SIZE]; // error message when ackStatus is -1
+
+  // status and telemetry published by the server
+  atomic_uint telSeq;   // odd while the telemetry is written
+  int32_t ownerPid;     // pid of the client in control, 0 if none
+  double frequencyMean;   // mean frequency as with FREQ
+  double frequencyStdDev; // standard deviation of the frequency
+  uint64_t skippedPeriods;  // number of periods skipped to catch up
+  uint64_t missedSteps;     // number of steps late by more than one step
+  uint64_t streamUnderruns; // number of periods without stream frame
+  uint64_t streamOverruns;  // number of dropped stream frames
+  shmParams_t params[SHM_MAX_CHAN]; // current parameters of the channels
+} shmSegment_t;
+
+// shmInit creates the shared memory segment name, as for shm_open, and
+// starts the thread serving it. Returns -1 if it fails.
+int shmInit(const char *name);
+
+#endif // SHM_H
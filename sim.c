@@ -0,0 +1,124 @@
+#include "sim.h"
+#include "gpio.h"
+#include "clock.h"
+#include "thread.h"
+#include "print.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// simEdge_t is the level of the channel outputs after a change.
+typedef struct {
+  uint64_t ticks; // tick count of the change
+  uint32_t level; // gpio bits of the channels at 3.3v
+} simEdge_t;
+
+simEdge_t simEdges[SIM_RING_SIZE];  // ring of edges
+atomic_uint simHead;                // index of the next edge to push
+atomic_uint simTail;                // index of the next edge to pop
+atomic_uint_fast64_t simDropped;    // number of edges dropped because the ring was full
+uint32_t simLevel;                  // level of the outputs (generator)
+uint64_t simStart;                  // tick count when the trace was opened
+FILE *simFile;                      // trace file
+int simCSV;                         // 1 when the trace is in CSV format, 0 for VCD
+
+// simRecord records the gpio outputs set and cleared by a write. Writes
+// that don't change an output are ignored. It must be called by a single
+// thread.
+void simRecord(uint32_t set, uint32_t clr) {
+  uint32_t level = ((simLevel | set) & ~clr) & chanMask;
+  if(level == simLevel)
+    return;
+  simLevel = level;
+  unsigned head = atomic_load_explicit(&simHead, memory_order_relaxed);
+  if(head - atomic_load_explicit(&simTail, memory_order_acquire) == SIM_RING_SIZE) {
+    atomic_fetch_add_explicit(&simDropped, 1, memory_order_relaxed);
+    return;
+  }
+  simEdges[head & (SIM_RING_SIZE-1)] = (simEdge_t){clockTicks(), level};
+  atomic_store_explicit(&simHead, head+1, memory_order_release);
+}
+
+// writeHeader writes the header of the trace file and the initial level
+// of the channels.
+static void writeHeader() {
+  if(simCSV) {
+    fprintf(simFile, "time_ns,channel,level\n");
+    for(int ch = 0; ch < nChan; ch++)
+      fprintf(simFile, "0,%d,0\n", ch);
+    return;
+  }
+  fprintf(simFile, "$timescale 1ns $end\n$scope module pwm $end\n");
+  for(int ch = 0; ch < nChan; ch++)
+    fprintf(simFile, "$var wire 1 %c ch%d_gpio%u $end\n", '!'+ch, ch, gpioID[ch]);
+  fprintf(simFile, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+  for(int ch = 0; ch < nChan; ch++)
+    fprintf(simFile, "0%c\n", '!'+ch);
+  fprintf(simFile, "$end\n");
+}
+
+// writeEdge writes the channel changes from level prev to edge e.
+static void writeEdge(uint32_t prev, const simEdge_t *e) {
+  unsigned long long ns = (e->ticks - simStart)/ticksPerNs;
+  if(!simCSV)
+    fprintf(simFile, "#%llu\n", ns);
+  for(int ch = 0; ch < nChan; ch++) {
+    if(((prev ^ e->level) & gpioBits[ch]) == 0)
+      continue;
+    int v = (e->level & gpioBits[ch]) != 0;
+    if(simCSV)
+      fprintf(simFile, "%llu,%d,%d\n", ns, ch, v);
+    else
+      fprintf(simFile, "%d%c\n", v, '!'+ch);
+  }
+}
+
+// simWriter is the thread saving the recorded edges in the trace file.
+static void* simWriter(void* dummy) {
+  (void)dummy;
+  uint32_t level = 0;
+  uint64_t dropped = 0;
+  while(1) {
+    unsigned tail = atomic_load_explicit(&simTail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&simHead, memory_order_acquire);
+    if(tail == head) {
+      fflush(simFile);
+      usleep(10000);
+      continue;
+    }
+    for(; tail != head; tail++) {
+      simEdge_t *e = simEdges + (tail & (SIM_RING_SIZE-1));
+      writeEdge(level, e);
+      level = e->level;
+    }
+    atomic_store_explicit(&simTail, tail, memory_order_release);
+    uint64_t n = atomic_load(&simDropped);
+    if(n != dropped) {
+      printWarn("sim warning: %llu edges dropped\n", (unsigned long long)(n - dropped));
+      dropped = n;
+    }
+  }
+  return NULL;
+}
+
+// simOpen creates the trace file path and starts recording the gpio 
+// writes. It must be called after gpio_init. Returns 0 when it succeeds
+// and -1 otherwise.
+int simOpen(const char *path) {
+  size_t len = strlen(path);
+  simCSV = len >= 4 && strcmp(path+len-4, ".csv") == 0;
+  if((simFile = fopen(path, "w")) == NULL) {
+    printErr("simOpen: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  writeHeader();
+  simStart = clockTicks();
+  if(startThread(&simWriter) < 0) {
+    fclose(simFile);
+    return -1;
+  }
+  gpioRecorded = true;
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// The simulation backend records the gpio output changes of the channels
+// as time stamped edges, so that the generated signals can be checked
+// without an oscilloscope. The generator pushes the edges in a lock free
+// ring, and a writer thread saves them in a trace file. The trace is a 
+// VCD file with one signal per channel, or a CSV file with one line per 
+// channel edge (time in ns, channel, level) when the file name ends with 
+// ".csv". Times are in nanoseconds since the trace was opened.
+//
+// The gpio writes are recorded on any host. On a raspberry PI, the outputs
+// are still driven.
+
+#define SIM_RING_SIZE 65536 // number of edges in the ring, must be a power of 2
+
+extern atomic_uint_fast64_t simDropped; // number of edges dropped because the ring was full
+
+// simOpen creates the trace file path and starts recording the gpio 
+// writes. It must be called after gpio_init. Returns 0 when it succeeds
+// and -1 otherwise.
+int simOpen(const char *path);
+
+#endif // SIM_H
@@ -0,0 +1,161 @@
+#include "stats.h"
+#include "clock.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#define STATS_PUBLISH_NS 100000000 // minimum duration between two publications
+#define STATS_ALPHA 0.1            // weight of a new frequency measure
+
+stats_t statsLive;      // statistics updated by the generator
+stats_t statsShared;    // last published statistics
+atomic_uint statsSeq;   // odd while statsShared is being modified
+uint64_t statsTicks;    // tick count of the last publication
+
+// statsBucket returns the histogram bucket of the value v.
+static inline int statsBucket(uint64_t v) {
+  if(v < (1 << STATS_SUB_BITS))
+    return v;
+  if(v >= (uint64_t)1 << STATS_MAX_BITS)
+    return STATS_BUCKETS-1;
+  int msb = 63 - __builtin_clzll(v), shift = msb - STATS_SUB_BITS;
+  return ((shift+1) << STATS_SUB_BITS) + ((v >> shift) & ((1 << STATS_SUB_BITS)-1));
+}
+
+// statsBucketValue returns the middle value of the histogram bucket b.
+static uint64_t statsBucketValue(int b) {
+  if(b < (1 << STATS_SUB_BITS))
+    return b;
+  int shift = (b >> STATS_SUB_BITS) - 1;
+  uint64_t low = (uint64_t)((b & ((1 << STATS_SUB_BITS)-1)) | (1 << STATS_SUB_BITS)) << shift;
+  return low + ((uint64_t)1 << shift)/2;
+}
+
+// publish copies the live statistics in the shared statistics.
+static void publish() {
+  statsTicks = statsLive.ticks = clockTicks();
+  atomic_fetch_add_explicit(&statsSeq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(&statsShared, &statsLive, sizeof(statsLive));
+  atomic_fetch_add_explicit(&statsSeq, 1, memory_order_release);
+}
+
+// statsReset clears the statistics and publishes them. It must be called
+// by the generator when it starts.
+void statsReset() {
+  memset(&statsLive, 0, sizeof(statsLive));
+  publish();
+}
+
+// statsPeriod records the duration of a pwm period and updates the mean
+// frequency. It must be called by the generator.
+void statsPeriod(double ns) {
+  uint64_t v = ns + .5;
+  statsLive.periods++;
+  statsLive.period[statsBucket(v)]++;
+  if(v > statsLive.periodMax)
+    statsLive.periodMax = v;
+  // update the mean frequency and its variance
+  // see: https://forge.in2p3.fr/dmsf/files/17104/view
+  double frequency = ns > 0 ? 1e9/ns : 0;
+  if(statsLive.frequencyMean == 0) {
+    statsLive.frequencyMean = frequency;
+    statsLive.frequencyVariance = 0;
+  } else {
+    double delta = frequency - statsLive.frequencyMean;
+    double incr = STATS_ALPHA * delta;
+    statsLive.frequencyMean += incr;
+    statsLive.frequencyVariance = (1 - STATS_ALPHA)*(statsLive.frequencyVariance + delta*incr);
+  }
+}
+
+// statsLate records a step reached ns after its deadline. missed is true
+// when it is late by more than one step. It must be called by the generator.
+void statsLate(double ns, bool missed) {
+  uint64_t v = ns + .5;
+  statsLive.lateSteps++;
+  statsLive.missedSteps += missed;
+  statsLive.late[statsBucket(v)]++;
+  if(v > statsLive.lateMax)
+    statsLive.lateMax = v;
+}
+
+// statsSkip records a pwm period skipped to catch up. It must be called 
+// by the generator.
+void statsSkip() {
+  statsLive.skippedPeriods++;
+}
+
+// statsPublish publishes the statistics if the previous publication is 
+// older than 100ms. It must be called by the generator once per period.
+void statsPublish() {
+  if((double)(clockTicks() - statsTicks) >= ticksPerNs*STATS_PUBLISH_NS)
+    publish();
+}
+
+// statsSnapshot copies the last published statistics in s. It may be 
+// called by any thread.
+void statsSnapshot(stats_t *s) {
+  unsigned seq0, seq1;
+  do {
+    seq0 = atomic_load_explicit(&statsSeq, memory_order_acquire);
+    memcpy(s, &statsShared, sizeof(statsShared));
+    atomic_thread_fence(memory_order_acquire);
+    seq1 = atomic_load_explicit(&statsSeq, memory_order_relaxed);
+  } while((seq0 & 1) != 0 || seq0 != seq1);
+}
+
+// statsFrequency returns the last published mean frequency and its 
+// standard deviation. It may be called by any thread.
+void statsFrequency(double *mean, double *stdDev) {
+  unsigned seq0, seq1;
+  double m, v;
+  do {
+    seq0 = atomic_load_explicit(&statsSeq, memory_order_acquire);
+    m = statsShared.frequencyMean;
+    v = statsShared.frequencyVariance;
+    atomic_thread_fence(memory_order_acquire);
+    seq1 = atomic_load_explicit(&statsSeq, memory_order_relaxed);
+  } while((seq0 & 1) != 0 || seq0 != seq1);
+  *mean = m;
+  *stdDev = sqrt(v);
+}
+
+// statsPercentile returns the value below which the fraction p of the 
+// values of the histogram hist are, or 0 when it is empty. The value is 
+// at most max, the biggest value recorded in hist, since the middle of a
+// bucket may be above it.
+uint64_t statsPercentile(const uint64_t hist[STATS_BUCKETS], double p, uint64_t max) {
+  uint64_t total = 0;
+  for(int b = 0; b < STATS_BUCKETS; b++)
+    total += hist[b];
+  if(total == 0)
+    return 0;
+  uint64_t rank = ceil(p*total), n = 0;
+  if(rank == 0)
+    rank = 1;
+  int b = 0;
+  while(b < STATS_BUCKETS-1 && (n += hist[b]) < rank)
+    b++;
+  uint64_t v = statsBucketValue(b);
+  return v > max ? max : v;
+}
+
+// formatStats writes the STAT response text of the statistics s in buf.
+// Returns the text length, or -1 if buf is too small.
+int formatStats(char *buf, int len, const stats_t *s) {
+  uint64_t p[3] = {
+    statsPercentile(s->period, .5, s->periodMax),
+    statsPercentile(s->period, .99, s->periodMax),
+    statsPercentile(s->period, .999, s->periodMax)
+  };
+  uint64_t late = statsPercentile(s->late, .99, s->lateMax);
+  int n = snprintf(buf, len, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+    (unsigned long long)s->periods, (unsigned long long)p[0], (unsigned long long)p[1],
+    (unsigned long long)p[2], (unsigned long long)s->periodMax, (unsigned long long)s->lateSteps,
+    (unsigned long long)s->missedSteps, (unsigned long long)late, (unsigned long long)s->lateMax,
+    (unsigned long long)s->skippedPeriods);
+  return n < len ? n : -1;
+}
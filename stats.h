@@ -0,0 +1,74 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The generator timing statistics are kept by the generator thread in
+// log bucketed histograms, and published every 100ms with a sequence 
+// counter so that other threads read a consistent snapshot without ever
+// blocking the generator. 
+//
+// A histogram bucket covers 1/64 of a power of two, so that the relative 
+// error of a value is below 1.6%. Values below 64ns are exact, and values
+// above 2^40ns (18 minutes) are counted in the last bucket.
+
+#define STATS_SUB_BITS 6  // log2 of the number of buckets per power of two
+#define STATS_MAX_BITS 40 // number of bits of the biggest value
+#define STATS_BUCKETS ((STATS_MAX_BITS-STATS_SUB_BITS+1) << STATS_SUB_BITS)
+
+// stats_t holds the timing statistics of the generator. Durations are 
+// in nanoseconds.
+typedef struct {
+  uint64_t ticks;                  // tick count of the publication
+  uint64_t periods;                // number of measured pwm periods
+  uint64_t periodMax;              // longest pwm period
+  uint64_t lateSteps;              // number of steps reached after their deadline
+  uint64_t missedSteps;            // number of steps late by more than one step
+  uint64_t lateMax;                // biggest step lateness
+  uint64_t skippedPeriods;         // number of periods skipped to catch up
+  double frequencyMean;            // mean frequency with exponentialy decaying weighting
+  double frequencyVariance;        // frequency variance with exponentialy decaying weighting
+  uint64_t period[STATS_BUCKETS];  // histogram of pwm period durations
+  uint64_t late[STATS_BUCKETS];    // histogram of step lateness
+} stats_t;
+
+// statsReset clears the statistics and publishes them. It must be called
+// by the generator when it starts.
+void statsReset();
+
+// statsPeriod records the duration of a pwm period and updates the mean
+// frequency. It must be called by the generator.
+void statsPeriod(double ns);
+
+// statsLate records a step reached ns after its deadline. missed is true
+// when it is late by more than one step. It must be called by the generator.
+void statsLate(double ns, bool missed);
+
+// statsSkip records a pwm period skipped to catch up. It must be called 
+// by the generator.
+void statsSkip();
+
+// statsPublish publishes the statistics if the previous publication is 
+// older than 100ms. It must be called by the generator once per period.
+void statsPublish();
+
+// statsSnapshot copies the last published statistics in s. It may be 
+// called by any thread.
+void statsSnapshot(stats_t *s);
+
+// statsFrequency returns the last published mean frequency and its 
+// standard deviation. It may be called by any thread.
+void statsFrequency(double *mean, double *stdDev);
+
+// statsPercentile returns the value below which the fraction p of the 
+// values of the histogram hist are, or 0 when it is empty. The value is 
+// at most max, the biggest value recorded in hist, since the middle of a
+// bucket may be above it.
+uint64_t statsPercentile(const uint64_t hist[STATS_BUCKETS], double p, uint64_t max);
+
+// formatStats writes the STAT response text of the statistics s in buf.
+// Returns the text length, or -1 if buf is too small.
+int formatStats(char *buf, int len, const stats_t *s);
+
+#endif // STATS_H
@@ -0,0 +1,86 @@
+#include "stream.h"
+
+#include <string.h>
+#include <unistd.h>
+
+frame_t streamFrames[STREAM_SIZE];     // ring of frames
+atomic_uint streamHead;                // index of the next frame to push
+atomic_uint streamTail;                // index of the next frame to pop
+atomic_uint_fast64_t streamUnderruns;  // number of periods without frame
+atomic_uint_fast64_t streamOverruns;   // number of dropped frames
+
+uint32_t streamMask;                   // channels held by the stream (generator)
+uint16_t streamDuty[MAX_CHAN];         // pwm values of the held channels (generator)
+
+// streamReset empties the ring and releases the channels. It must be
+// called before starting the generator.
+void streamReset() {
+  atomic_store(&streamHead, 0);
+  atomic_store(&streamTail, 0);
+  streamMask = 0;
+}
+
+// streamStart resets the underrun and overrun counters.
+void streamStart() {
+  atomic_store(&streamUnderruns, 0);
+  atomic_store(&streamOverruns, 0);
+}
+
+// streamStop pushes a frame releasing the channels, waiting for a free
+// frame in the ring if needed. It must be called by the producer.
+void streamStop() {
+  unsigned head = atomic_load_explicit(&streamHead, memory_order_relaxed);
+  while(atomic_load(&generatorRunning) && head - atomic_load(&streamTail) == STREAM_SIZE)
+    usleep(100);
+  streamFrames[head & (STREAM_SIZE-1)].mask = 0;
+  atomic_store_explicit(&streamHead, head+1, memory_order_release);
+  generatorWake();
+}
+
+// streamPush pushes a frame in the ring. Returns 0 if it succeeds, or -1
+// if the ring is full in which case the frame is dropped and counted as
+// an overrun. It must be called by a single producer thread.
+int streamPush(const frame_t *f) {
+  unsigned head = atomic_load_explicit(&streamHead, memory_order_relaxed);
+  if(head - atomic_load_explicit(&streamTail, memory_order_acquire) == STREAM_SIZE) {
+    atomic_fetch_add_explicit(&streamOverruns, 1, memory_order_relaxed);
+    return -1;
+  }
+  streamFrames[head & (STREAM_SIZE-1)] = *f;
+  atomic_store_explicit(&streamHead, head+1, memory_order_release);
+  generatorWake();
+  return 0;
+}
+
+// streamPending returns true when the ring holds frames not yet consumed
+// by the generator.
+bool streamPending() {
+  return atomic_load(&streamTail) != atomic_load(&streamHead);
+}
+
+// streamIdle returns true when no channel is held by the stream and the
+// ring is empty. It must be called by the generator.
+bool streamIdle() {
+  return streamMask == 0 && !streamPending();
+}
+
+// streamStep pops the next frame if any, and stores the pwm values of the
+// channels held by the stream in pwmval. It must be called once per pwm
+// period by the generator.
+void streamStep(int pwmval[MAX_CHAN]) {
+  unsigned tail = atomic_load_explicit(&streamTail, memory_order_relaxed);
+  if(tail != atomic_load_explicit(&streamHead, memory_order_acquire)) {
+    frame_t *f = streamFrames + (tail & (STREAM_SIZE-1));
+    streamMask = f->mask;
+    for(uint32_t m = f->mask; m != 0; m &= m-1) {
+      int ch = __builtin_ctz(m);
+      streamDuty[ch] = f->duty[ch];
+    }
+    atomic_store_explicit(&streamTail, tail+1, memory_order_release);
+  } else if(streamMask != 0)
+    atomic_fetch_add_explicit(&streamUnderruns, 1, memory_order_relaxed);
+  for(uint32_t m = streamMask; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    pwmval[ch] = ((uint64_t)streamDuty[ch]*chanMaxValue(ch) + 32767)/65535;
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "generator.h"
+
+// The stream passes pwm values from the command handler to the generator
+// through a lock free single producer single consumer ring of frames. The
+// generator consumes one frame per pwm period. The channels of the last
+// consumed frame keep its values until a frame with an empty mask releases
+// them. Frames pushed when the ring is full are dropped and counted as
+// overruns. Periods without a frame while channels are held by the 
+// stream are counted as underruns.
+
+#define STREAM_SIZE 1024 // number of frames in the ring, must be a power of 2
+
+// frame_t holds the pwm values of the channels set in mask (65535 = 1).
+typedef struct {
+  uint32_t mask;             // bit set for each channel with a value
+  uint16_t duty[MAX_CHAN];   // pwm value of the channels
+} frame_t;
+
+extern atomic_uint_fast64_t streamUnderruns; // number of periods without frame
+extern atomic_uint_fast64_t streamOverruns;  // number of dropped frames
+
+// streamStart resets the underrun and overrun counters.
+void streamStart();
+
+// streamStop pushes a frame releasing the channels, waiting for a free
+// frame in the ring if needed. It must be called by the producer.
+void streamStop();
+
+// streamPush pushes a frame in the ring. Returns 0 if it succeeds, or -1
+// if the ring is full in which case the frame is dropped and counted as
+// an overrun. It must be called by a single producer thread.
+int streamPush(const frame_t *f);
+
+// streamPending returns true when the ring holds frames not yet consumed
+// by the generator.
+bool streamPending();
+
+// streamIdle returns true when no channel is held by the stream and the
+// ring is empty. It must be called by the generator.
+bool streamIdle();
+
+// streamStep pops the next frame if any, and stores the pwm values of the
+// channels held by the stream in pwmval. It must be called once per pwm
+// period by the generator.
+void streamStep(int pwmval[MAX_CHAN]);
+
+// streamReset empties the ring and releases the channels. It must be
+// called before starting the generator.
+void streamReset();
+
+#endif // STREAM_H
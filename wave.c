@@ -0,0 +1,271 @@
+#include "wave.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+// The waveform kernel computes the pwm value of all channels from their
+// phase with integer arithmetic only. Sinusoidal values are linearly 
+// interpolated between the entries of a sine table, and triangular
+// values are computed from the phase. Both are computed for all channels
+// and the result is selected with a mask so that there is no branch per 
+// channel. The period and phase are exact whatever the pwm period 
+// durations since the phases are advanced by the elapsed time.
+//
+// The kernel uses AVX2 or SSE2 on x86, NEON on aarch64, and falls back
+// to scalar code otherwise. The 32x32 bit products are computed in 64 bit
+// lanes and only the low 32 bits of their shifted value are kept, which
+// are the same with a logical or an arithmetic shift. All kernels produce
+// the same pwm values as the scalar code.
+
+// sinLUT holds the sine of a period in 2^SIN_LUT_BITS entries in 1/2^30
+// units. The extra last entry is the first one for the interpolation.
+int32_t sinLUT[(1 << SIN_LUT_BITS) + 1];
+
+// waveReset clears the parameters of all channels.
+void waveReset(wave_t *w) {
+  memset(w, 0, sizeof(*w));
+  if(sinLUT[1 << (SIN_LUT_BITS-2)] != 0)
+    return;
+  for(int i = 0; i <= 1 << SIN_LUT_BITS; i++)
+    sinLUT[i] = lrint(sin(2*M_PI*i/(1 << SIN_LUT_BITS))*(1 << 30));
+}
+
+// waveSet sets the generator parameters of channel ch. The pwm values
+// are in steps of the resolution of the channel.
+void waveSet(wave_t *w, int ch, const genParams_t *p) {
+  w->y0[ch] = lrint(p->y0*chanMaxValue(ch)*(1 << WAVE_FRAC_BITS));
+  w->a[ch] = lrint(p->a*chanMaxValue(ch)*(1 << WAVE_FRAC_BITS));
+  w->phase[ch] = p->phase;
+  w->freq[ch] = p->freq;
+  if(p->tri)
+    w->triMask |= 1 << ch;
+  else
+    w->triMask &= ~(1 << ch);
+  if(p->tbl == NULL) {
+    w->arbMask &= ~(1 << ch);
+    return;
+  }
+  w->arbMask |= 1 << ch;
+  w->arb[ch].tbl = p->tbl;
+  w->arb[ch].len = p->len;
+  w->arb[ch].loop = p->loop;
+  w->arb[ch].pos = p->pos;
+  w->arb[ch].step = p->step;
+}
+
+// arbAdvance advances the playback position of the arbitrary variations 
+// of the channels in mask by ns nanoseconds. The position is advanced by
+// chunks of at most 2^28ns (268ms) so that the product with the step 
+// doesn't overflow.
+static void arbAdvance(wave_t *w, uint32_t mask, uint64_t ns) {
+  for(uint32_t m = w->arbMask & mask; m != 0; m &= m-1) {
+    arb_t *a = w->arb + __builtin_ctz(m);
+    uint64_t end = (uint64_t)a->len << ARB_FRAC_BITS;
+    for(uint64_t left = ns; left > 0 && a->step != 0;) {
+      uint64_t chunk = left < (1 << 28) ? left : (1 << 28);
+      left -= chunk;
+      a->pos += a->step*chunk;
+      if(a->pos < end)
+        continue;
+      if(a->loop)
+        a->pos %= end;
+      else {
+        // hold the last sample
+        a->pos = end - ((uint64_t)1 << ARB_FRAC_BITS);
+        a->step = 0;
+      }
+    }
+  }
+}
+
+// arbStep stores in pwmval the pwm value of the channels with an arbitrary
+// variation, linearly interpolated between two samples.
+static void arbStep(wave_t *w, int pwmval[WAVE_SIZE]) {
+  for(uint32_t m = w->arbMask; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    arb_t *a = w->arb+ch;
+    uint32_t i = a->pos >> ARB_FRAC_BITS, j = i+1;
+    if(j == a->len)
+      j = a->loop ? 0 : i;
+    int32_t v0 = a->tbl[i], v1 = a->tbl[j], frac = (a->pos >> (ARB_FRAC_BITS-16)) & 0xFFFF;
+    int32_t v = v0 + (int32_t)(((int64_t)(v1 - v0)*frac) >> 16);
+    pwmval[ch] = ((int64_t)v*chanMaxValue(ch) + 32767)/65535;
+  }
+}
+
+// waveAdvance advances the variation of the n first channels by ns 
+// nanoseconds.
+void waveAdvance(wave_t *w, int n, uint64_t ns) {
+  // the phase wraps modulo 2^64 which is a full period
+  for(int ch = 0; ch < n; ch++)
+    w->phase[ch] += w->freq[ch]*ns;
+  if(w->arbMask != 0)
+    arbAdvance(w, w->arbMask, ns);
+}
+
+// waveAdvanceMask advances the variation of the channels whose bit is
+// set in mask by ns nanoseconds.
+void waveAdvanceMask(wave_t *w, uint32_t mask, uint64_t ns) {
+  for(uint32_t m = mask; m != 0; m &= m-1) {
+    int ch = __builtin_ctz(m);
+    w->phase[ch] += w->freq[ch]*ns;
+  }
+  if(w->arbMask & mask)
+    arbAdvance(w, mask, ns);
+}
+
+// waveStatic returns true when the pwm values of the n first channels
+// don't change with time.
+bool waveStatic(const wave_t *w, int n) {
+  uint64_t freq = 0;
+  for(int ch = 0; ch < n; ch++)
+    freq |= w->freq[ch];
+  for(uint32_t m = w->arbMask; m != 0; m &= m-1)
+    freq |= w->arb[__builtin_ctz(m)].step;
+  return freq == 0;
+}
+
+// waveStep stores in pwmval the number of steps the output of the n first
+// channels must stay high at the current phase of their variation. 
+// pwmval must hold WAVE_SIZE values.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+const char *waveKernel = "avx2";
+
+void waveStep(wave_t *w, int n, int pwmval[WAVE_SIZE]) {
+  const __m256i bits = _mm256_set_epi64x(8, 4, 2, 1), fracMask = _mm256_set1_epi64x(0xFFFF);
+  const __m256i quarter = _mm256_set1_epi64x((uint64_t)1 << 62), sign = _mm256_set1_epi64x(0x80000000);
+  const __m256i one = _mm256_set1_epi64x(1 << 30), pack = _mm256_set_epi32(7, 5, 3, 1, 6, 4, 2, 0);
+  const __m128i half = _mm_set1_epi32(1 << (WAVE_FRAC_BITS-1));
+  for(int i = 0; i < n; i += 4) {
+    __m256i ph = _mm256_load_si256((const __m256i*)(w->phase+i));
+    // sine interpolated between two table entries
+    __m256i idx = _mm256_srli_epi64(ph, 64-SIN_LUT_BITS);
+    __m128i g0 = _mm256_i64gather_epi32(sinLUT, idx, 4), g1 = _mm256_i64gather_epi32(sinLUT+1, idx, 4);
+    __m256i s0 = _mm256_cvtepi32_epi64(g0), ds = _mm256_cvtepi32_epi64(_mm_sub_epi32(g1, g0));
+    __m256i frac = _mm256_and_si256(_mm256_srli_epi64(ph, 48-SIN_LUT_BITS), fracMask);
+    __m256i s = _mm256_add_epi32(s0, _mm256_srli_epi64(_mm256_mul_epi32(ds, frac), 16));
+    // triangle rising from 0 at phase 0 to 1 at 1/4 and -1 at 3/4
+    __m256i d = _mm256_xor_si256(_mm256_srli_epi64(_mm256_add_epi64(ph, quarter), 32), sign);
+    __m256i t = _mm256_sub_epi32(one, _mm256_abs_epi32(d));
+    // select the variation
+    __m256i isTri = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(w->triMask >> i), bits), bits);
+    __m256i v = _mm256_blendv_epi8(s, t, isTri);
+    // pwm value
+    __m256i a = _mm256_cvtepi32_epi64(_mm_load_si128((const __m128i*)(w->a+i)));
+    __m256i y = _mm256_permutevar8x32_epi32(_mm256_srli_epi64(_mm256_mul_epi32(a, v), 30), pack);
+    __m128i y0 = _mm_load_si128((const __m128i*)(w->y0+i));
+    __m128i val = _mm_add_epi32(_mm_add_epi32(y0, _mm256_castsi256_si128(y)), half);
+    _mm_storeu_si128((__m128i*)(pwmval+i), _mm_srai_epi32(val, WAVE_FRAC_BITS));
+  }
+  if(w->arbMask != 0)
+    arbStep(w, pwmval);
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+const char *waveKernel = "sse2";
+
+// mul32 returns the products of the signed 32 bit integers in the low half
+// of the 64 bit lanes of a and b. SSE2 only has the unsigned product which
+// is corrected for the negative operands.
+static inline __m128i mul32(__m128i a, __m128i b) {
+  __m128i c = _mm_add_epi32(_mm_and_si128(_mm_srai_epi32(a, 31), b), _mm_and_si128(_mm_srai_epi32(b, 31), a));
+  return _mm_sub_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(c, 32));
+}
+
+// blend returns b where mask is set and a otherwise.
+static inline __m128i blend(__m128i a, __m128i b, __m128i mask) {
+  return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b));
+}
+
+void waveStep(wave_t *w, int n, int pwmval[WAVE_SIZE]) {
+  const __m128i bits = _mm_set_epi64x(2, 1), fracMask = _mm_set1_epi64x(0xFFFF);
+  const __m128i quarter = _mm_set1_epi64x((uint64_t)1 << 62), sign = _mm_set1_epi64x(0x80000000);
+  const __m128i one = _mm_set1_epi64x(1 << 30), half = _mm_set1_epi32(1 << (WAVE_FRAC_BITS-1));
+  for(int i = 0; i < n; i += 2) {
+    __m128i ph = _mm_load_si128((const __m128i*)(w->phase+i));
+    // sine interpolated between two table entries, SSE2 has no gather
+    uint32_t i0 = w->phase[i] >> (64-SIN_LUT_BITS), i1 = w->phase[i+1] >> (64-SIN_LUT_BITS);
+    __m128i s0 = _mm_set_epi64x(sinLUT[i1], sinLUT[i0]);
+    __m128i ds = _mm_set_epi64x(sinLUT[i1+1] - sinLUT[i1], sinLUT[i0+1] - sinLUT[i0]);
+    __m128i frac = _mm_and_si128(_mm_srli_epi64(ph, 48-SIN_LUT_BITS), fracMask);
+    __m128i s = _mm_add_epi32(s0, _mm_srli_epi64(mul32(ds, frac), 16));
+    // triangle rising from 0 at phase 0 to 1 at 1/4 and -1 at 3/4
+    __m128i d = _mm_xor_si128(_mm_srli_epi64(_mm_add_epi64(ph, quarter), 32), sign);
+    __m128i m = _mm_srai_epi32(d, 31);
+    __m128i t = _mm_sub_epi32(one, _mm_sub_epi32(_mm_xor_si128(d, m), m));
+    // select the variation, only the low half of the lanes matters
+    __m128i isTri = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi64x(w->triMask >> i), bits), bits);
+    __m128i v = blend(s, t, isTri);
+    // pwm value
+    __m128i a = _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i*)(w->a+i)), _mm_setzero_si128());
+    __m128i y = _mm_shuffle_epi32(_mm_srli_epi64(mul32(a, v), 30), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i y0 = _mm_loadl_epi64((const __m128i*)(w->y0+i));
+    __m128i val = _mm_add_epi32(_mm_add_epi32(y0, y), half);
+    _mm_storel_epi64((__m128i*)(pwmval+i), _mm_srai_epi32(val, WAVE_FRAC_BITS));
+  }
+  if(w->arbMask != 0)
+    arbStep(w, pwmval);
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+const char *waveKernel = "neon";
+
+void waveStep(wave_t *w, int n, int pwmval[WAVE_SIZE]) {
+  const uint32x2_t bits = vcreate_u32((uint64_t)2 << 32 | 1), sign = vdup_n_u32(0x80000000);
+  const uint64x2_t quarter = vdupq_n_u64((uint64_t)1 << 62), fracMask = vdupq_n_u64(0xFFFF);
+  const int32x2_t one = vdup_n_s32(1 << 30), half = vdup_n_s32(1 << (WAVE_FRAC_BITS-1));
+  for(int i = 0; i < n; i += 2) {
+    uint64x2_t ph = vld1q_u64(w->phase+i);
+    // sine interpolated between two table entries, NEON has no gather
+    uint32_t i0 = w->phase[i] >> (64-SIN_LUT_BITS), i1 = w->phase[i+1] >> (64-SIN_LUT_BITS);
+    int32x2_t s0 = vset_lane_s32(sinLUT[i1], vdup_n_s32(sinLUT[i0]), 1);
+    int32x2_t s1 = vset_lane_s32(sinLUT[i1+1], vdup_n_s32(sinLUT[i0+1]), 1);
+    int32x2_t frac = vreinterpret_s32_u32(vmovn_u64(vandq_u64(vshrq_n_u64(ph, 48-SIN_LUT_BITS), fracMask)));
+    int32x2_t s = vadd_s32(s0, vshrn_n_s64(vmull_s32(vsub_s32(s1, s0), frac), 16));
+    // triangle rising from 0 at phase 0 to 1 at 1/4 and -1 at 3/4
+    int32x2_t d = vreinterpret_s32_u32(veor_u32(vshrn_n_u64(vaddq_u64(ph, quarter), 32), sign));
+    int32x2_t t = vsub_s32(one, vabs_s32(d));
+    // select the variation
+    uint32x2_t isTri = vtst_u32(vdup_n_u32(w->triMask >> i), bits);
+    int32x2_t v = vbsl_s32(isTri, t, s);
+    // pwm value
+    int32x2_t y = vshrn_n_s64(vmull_s32(vld1_s32(w->a+i), v), 30);
+    int32x2_t val = vadd_s32(vadd_s32(vld1_s32(w->y0+i), y), half);
+    vst1_s32(pwmval+i, vshr_n_s32(val, WAVE_FRAC_BITS));
+  }
+  if(w->arbMask != 0)
+    arbStep(w, pwmval);
+}
+
+#else
+
+const char *waveKernel = "scalar";
+
+void waveStep(wave_t *w, int n, int pwmval[WAVE_SIZE]) {
+  for(int ch = 0; ch < n; ch++) {
+    uint64_t ph = w->phase[ch];
+    // sine interpolated between two table entries
+    uint32_t i = ph >> (64-SIN_LUT_BITS);
+    int64_t frac = (ph >> (48-SIN_LUT_BITS)) & 0xFFFF;
+    int32_t s = sinLUT[i] + (int32_t)(((sinLUT[i+1] - sinLUT[i])*frac) >> 16);
+    // triangle rising from 0 at phase 0 to 1 at 1/4 and -1 at 3/4
+    int64_t d = (int64_t)((ph + ((uint64_t)1 << 62)) >> 32) - 0x80000000LL;
+    int32_t t = (1LL << 30) - (d < 0 ? -d : d);
+    // select the variation
+    int32_t isTri = -(int32_t)((w->triMask >> ch) & 1);
+    int32_t v = (s & ~isTri) | (t & isTri);
+    pwmval[ch] = (w->y0[ch] + (int32_t)(((int64_t)w->a[ch]*v) >> 30) + (1 << (WAVE_FRAC_BITS-1))) >> WAVE_FRAC_BITS;
+  }
+  if(w->arbMask != 0)
+    arbStep(w, pwmval);
+}
+
+#endif
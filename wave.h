@@ -0,0 +1,68 @@
+#ifndef WAVE_H
+#define WAVE_H
+
+#include "generator.h"
+
+// WAVE_SIZE is MAX_CHAN rounded up to a multiple of 4 so that the
+// kernel loops may be vectorized without a scalar tail loop.
+#define WAVE_SIZE ((MAX_CHAN+3) & ~3)
+
+#define SIN_LUT_BITS 10   // log2 of the number of sine table entries
+#define ARB_FRAC_BITS 44  // number of fractional bits of arbitrary playback positions
+#define WAVE_FRAC_BITS 14 // number of fractional bits of the pwm values, at most 30-MAX_RESOLUTION
+
+// arb_t is the playback state of an arbitrary variation.
+typedef struct {
+  const uint16_t *tbl; // samples (65535 = 1)
+  uint32_t len;        // number of samples
+  uint32_t loop;       // 1 to play the samples in loop, 0 to hold the last one
+  uint64_t pos;        // playback position in 1/2^ARB_FRAC_BITS samples
+  uint64_t step;       // playback step per ns in 1/2^ARB_FRAC_BITS samples
+} arb_t;
+
+// wave_t holds the generator parameters of all channels as structure
+// of arrays so that the waveform kernel advances all channels at once.
+// The variations are direct digital synthesizers: the phase of each
+// channel is a 64 bit integer where 2^64 is a full period, advanced by
+// the elapsed time. The value is read from a sine table, or computed 
+// for triangular variations. Constant channels have a zero amplitude and
+// frequency. Unused channels must be zero. Arbitrary variations are
+// played from their samples after the kernel computed the other channels.
+typedef struct {
+  int32_t y0[WAVE_SIZE]    __attribute__((aligned(32))); // average in 1/2^WAVE_FRAC_BITS pwm steps
+  int32_t a[WAVE_SIZE]     __attribute__((aligned(32))); // amplitude in 1/2^WAVE_FRAC_BITS pwm steps
+  uint64_t phase[WAVE_SIZE] __attribute__((aligned(32))); // phase (2^64 = period)
+  uint64_t freq[WAVE_SIZE]  __attribute__((aligned(32))); // phase increment per ns
+  uint32_t triMask;    // bit set for each channel with a triangular variation
+  uint32_t arbMask;    // bit set for each channel with an arbitrary variation
+  arb_t arb[MAX_CHAN]; // playback state of arbitrary variations
+} wave_t;
+
+// waveKernel is the name of the waveform kernel used by waveStep.
+extern const char *waveKernel;
+
+// waveReset clears the parameters of all channels.
+void waveReset(wave_t *w);
+
+// waveSet sets the generator parameters of channel ch. The pwm values
+// are in steps of the resolution of the channel.
+void waveSet(wave_t *w, int ch, const genParams_t *p);
+
+// waveAdvance advances the variation of the n first channels by ns 
+// nanoseconds.
+void waveAdvance(wave_t *w, int n, uint64_t ns);
+
+// waveAdvanceMask advances the variation of the channels whose bit is
+// set in mask by ns nanoseconds.
+void waveAdvanceMask(wave_t *w, uint32_t mask, uint64_t ns);
+
+// waveStatic returns true when the pwm values of the n first channels
+// don't change with time.
+bool waveStatic(const wave_t *w, int n);
+
+// waveStep stores in pwmval the number of steps the output of the n first
+// channels must stay high at the current phase of their variation. 
+// pwmval must hold WAVE_SIZE values.
+void waveStep(wave_t *w, int n, int pwmval[WAVE_SIZE]);
+
+#endif // WAVE_H